@@ -0,0 +1,705 @@
+// Benchmarks for boiling internals. The whole program is compiled into
+// this binary so the benchmarks call the real functions. Results are
+// printed to stdout as JSON, progress goes to stderr.
+#define BOILING_NO_MAIN
+#include "../main.c"
+
+#define MIN_SAMPLES   5
+#define MAX_SAMPLES   10000
+#define MIN_BENCH_SEC 0.25
+
+typedef struct {
+  const char *name;
+  const char *input;
+  // Bytes or items processed by one iteration, used for throughput.
+  double work;
+  const char *unit;
+  // Set for benchmarks that also report bytes per TSC cycle.
+  double tsc_hz;
+  double samples[MAX_SAMPLES];
+  size_t nsamples;
+} Bench;
+
+bool first_result = true;
+
+int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+double percentile(Bench *bench, double p)
+{
+  size_t i = (size_t) (p * (bench->nsamples - 1) + 0.5);
+  return bench->samples[i];
+}
+
+void report(Bench *bench)
+{
+  qsort(bench->samples, bench->nsamples, sizeof(double), compare_doubles);
+  double total = 0;
+  for (size_t i = 0; i < bench->nsamples; i++)
+    total += bench->samples[i];
+  double mean = total / bench->nsamples;
+  double p50 = percentile(bench, 0.50);
+  printf("%s\n    {\"name\": \"%s\", \"input\": \"%s\", \"samples\": %zu, "
+         "\"p50_ns\": %.0f, \"p99_ns\": %.0f, \"mean_ns\": %.0f, "
+         "\"throughput\": %.3f, \"throughput_unit\": \"%s/s\"",
+         first_result ? "" : ",", bench->name, bench->input, bench->nsamples,
+         p50 * 1e9, percentile(bench, 0.99) * 1e9, mean * 1e9,
+         bench->work / p50, bench->unit);
+  if (bench->tsc_hz > 0)
+    printf(", \"bytes_per_cycle\": %.3f", bench->work * 1e6 / (p50 * bench->tsc_hz));
+  printf("}");
+  first_result = false;
+  fprintf(stderr, "%-22s %-14s p50 %12.0f ns  p99 %12.0f ns\n", bench->name, bench->input,
+          p50 * 1e9, percentile(bench, 0.99) * 1e9);
+}
+
+// Runs `fn` until at least MIN_SAMPLES samples and MIN_BENCH_SEC seconds
+// are collected. `setup` and `teardown` run around every sample but are
+// not timed.
+void run_bench(Bench *bench, void (*fn)(void *ctx, size_t i), void (*setup)(void *ctx, size_t i),
+               void (*teardown)(void *ctx, size_t i), void *ctx)
+{
+  bench->nsamples = 0;
+  double spent = 0;
+  while (bench->nsamples < MAX_SAMPLES && (bench->nsamples < MIN_SAMPLES || spent < MIN_BENCH_SEC)) {
+    size_t i = bench->nsamples;
+    if (setup != NULL)
+      setup(ctx, i);
+    double start = now_seconds();
+    fn(ctx, i);
+    double elapsed = now_seconds() - start;
+    if (teardown != NULL)
+      teardown(ctx, i);
+    bench->samples[bench->nsamples++] = elapsed;
+    spent += elapsed;
+  }
+  report(bench);
+}
+
+// Synthetic config with roughly `lines` lines: a Core section followed by
+// language sections and comments.
+char *generate_config(size_t lines, size_t *size)
+{
+  size_t capacity = lines * 48 + 256;
+  char *config = malloc(capacity);
+  size_t len = sprintf(config, "[Core]\nname=John Smith\ngitrepo=true\n");
+  const char *langs[] = { "clang", "cpp", "py" };
+  for (size_t i = 3; i < lines; i += 5) {
+    len += sprintf(config + len, "\n# section %zu\n[Language]\nname=%s\nsrc=./src%zu   \n", i, langs[i % 3], i);
+  }
+  *size = len;
+  return config;
+}
+
+typedef struct {
+  char *config;
+  size_t size;
+  ConfigTokens *tokens;
+  Arena arena;
+} ConfigBench;
+
+void bench_lex(void *ctx, size_t i)
+{
+  (void) i;
+  ConfigBench *cb = ctx;
+  lex_config(&cb->arena, cb->config, cb->size, NULL);
+}
+
+void release_arena(void *ctx, size_t i)
+{
+  (void) i;
+  ConfigBench *cb = ctx;
+  arena_release(&cb->arena);
+}
+
+void bench_parse(void *ctx, size_t i)
+{
+  (void) i;
+  ConfigBench *cb = ctx;
+  destroy_configs(parse_config(cb->tokens, NULL));
+}
+
+void bench_config(size_t lines, const char *input)
+{
+  ConfigBench cb = { 0 };
+  cb.config = generate_config(lines, &cb.size);
+
+  Bench bench = { .name = "lex_config", .input = input, .work = cb.size / 1e6, .unit = "MB" };
+  run_bench(&bench, bench_lex, NULL, release_arena, &cb);
+
+  Arena scratch = { 0 };
+  cb.tokens = lex_config(&scratch, cb.config, cb.size, NULL);
+  bench = (Bench) { .name = "parse_config", .input = input, .work = cb.tokens->size, .unit = "tokens" };
+  run_bench(&bench, bench_parse, NULL, NULL, &cb);
+  arena_release(&scratch);
+  free(cb.config);
+}
+
+// TSC ticks per second, measured against the monotonic clock. Zero
+// where there is no TSC.
+double measure_tsc_hz()
+{
+#ifdef LEXER_SIMD
+  double start = now_seconds();
+  uint64_t ticks = __rdtsc();
+  while (now_seconds() - start < 0.05)
+    ;
+  return (__rdtsc() - ticks) / (now_seconds() - start);
+#else
+  return 0;
+#endif
+}
+
+typedef struct {
+  LexScanner scan;
+  char *config;
+  size_t size;
+  size_t hits;
+} ScanBench;
+
+// Walks the config the way the lexer scans keys: from one `=`, space or
+// newline to the next.
+void bench_scan(void *ctx, size_t i)
+{
+  (void) i;
+  ScanBench *sb = ctx;
+  size_t hits = 0;
+  for (size_t at = scan_token(sb->scan, sb->config, 0, sb->size, '=', ' ', '\n'); at < sb->size;
+       at = scan_token(sb->scan, sb->config, at + 1, sb->size, '=', ' ', '\n'))
+    hits++;
+  sb->hits = hits;
+}
+
+// Config whose values are `width` characters long, like the generated
+// configs with long paths and descriptions.
+char *generate_wide_config(size_t lines, size_t width, size_t *size)
+{
+  char *config = malloc(lines * (width + 16) + 16);
+  size_t len = sprintf(config, "[Core]\n");
+  for (size_t i = 0; i < lines; i++) {
+    len += sprintf(config + len, "key%zu=", i % 1000);
+    memset(config + len, 'a' + i % 26, width);
+    len += width;
+    config[len++] = '\n';
+  }
+  *size = len;
+  return config;
+}
+
+void bench_scanners(const char *input, char *config, size_t size, double tsc_hz)
+{
+  struct {
+    const char *name;
+    LexScanner scan;
+    bool supported;
+  } scanners[] = {
+    { "scan_scalar", scan_scalar, true },
+#ifdef LEXER_SIMD
+    { "scan_sse2", scan_sse2, __builtin_cpu_supports("sse2") },
+    { "scan_avx2", scan_avx2, __builtin_cpu_supports("avx2") },
+#endif
+  };
+  for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); i++) {
+    if (!scanners[i].supported)
+      continue;
+    ScanBench sb = { .scan = scanners[i].scan, .config = config, .size = size };
+    Bench bench = { .name = scanners[i].name, .input = input, .work = size / 1e6, .unit = "MB", .tsc_hz = tsc_hz };
+    run_bench(&bench, bench_scan, NULL, NULL, &sb);
+  }
+}
+
+void bench_lex_scan()
+{
+  double tsc_hz = measure_tsc_hz();
+  size_t size;
+  char *config = generate_config(100000, &size);
+  bench_scanners("100k_lines", config, size, tsc_hz);
+  free(config);
+
+  config = generate_wide_config(100000, 120, &size);
+  bench_scanners("100k_wide_lines", config, size, tsc_hz);
+  ConfigBench cb = { .config = config, .size = size };
+  Bench bench = { .name = "lex_config", .input = "100k_wide_lines", .work = size / 1e6, .unit = "MB" };
+  run_bench(&bench, bench_lex, NULL, release_arena, &cb);
+  free(config);
+}
+
+#define LOOKUPS 100000
+
+typedef struct {
+  Config *conf;
+  char **keys;
+  size_t *order;
+} LookupBench;
+
+void bench_lookup_round(void *ctx, size_t i)
+{
+  (void) i;
+  LookupBench *lb = ctx;
+  size_t found = 0;
+  for (size_t j = 0; j < LOOKUPS; j++)
+    found += get_conf_entry(lb->conf, lb->keys[lb->order[j]]) != NULL;
+  assert(found == LOOKUPS);
+}
+
+// Fills a config with `count` keys and measures rounds of LOOKUPS
+// lookups of existing keys in random order.
+void bench_conf_lookup(size_t count, const char *input)
+{
+  Arena arena = { 0 };
+  LookupBench lb;
+  lb.conf = create_config(&arena);
+  lb.keys = arena_alloc(&arena, sizeof(char *) * count);
+  for (size_t i = 0; i < count; i++) {
+    char buf[32];
+    int len = sprintf(buf, "key%zu", i);
+    lb.keys[i] = arena_strndup(&arena, buf, len);
+    add_conf_entry(lb.conf, lb.keys[i], lb.keys[i]);
+  }
+  lb.order = malloc(sizeof(size_t) * LOOKUPS);
+  uint64_t state = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    lb.order[i] = state % count;
+  }
+
+  Bench bench = { .name = "get_conf_entry", .input = input, .work = LOOKUPS, .unit = "lookups" };
+  run_bench(&bench, bench_lookup_round, NULL, NULL, &lb);
+  free(lb.order);
+  arena_release(&arena);
+}
+
+// Template text of `size` bytes with a placeholder every `every` bytes.
+char *generate_template(size_t size, size_t every)
+{
+  char *data = malloc(size + 1);
+  for (size_t i = 0; i < size; i++)
+    data[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+  for (size_t i = every; i + 10 < size; i += every)
+    memcpy(data + i, i % 2 ? "[[Name]]" : "[[Year]]", 8);
+  data[size] = '\0';
+  return data;
+}
+
+typedef struct {
+  Template tpl;
+  Placeholders placeholders;
+  char *dst;
+  IoBackend io;
+} RenderBench;
+
+void bench_compile(void *ctx, size_t i)
+{
+  (void) i;
+  RenderBench *rb = ctx;
+  rb->tpl.items = NULL;
+  rb->tpl.size = rb->tpl.capacity = 0;
+  compile_template(&rb->tpl);
+}
+
+void free_segments(void *ctx, size_t i)
+{
+  (void) i;
+  RenderBench *rb = ctx;
+  free(rb->tpl.items);
+}
+
+void bench_render(void *ctx, size_t i)
+{
+  (void) i;
+  RenderBench *rb = ctx;
+  IoBatch batch = { 0 };
+  io_batch_template(&batch, &rb->tpl, &rb->placeholders, rb->dst, O_TRUNC, 0644);
+  submit_io_batch(&batch, rb->io);
+  assert(batch.items[0].result == 0);
+  destroy_io_batch(&batch);
+}
+
+void bench_template(size_t size, const char *input, char *dir)
+{
+  RenderBench rb = { 0 };
+  rb.tpl.data = generate_template(size, 1024);
+  rb.tpl.datasize = size;
+  rb.placeholders.values[PLACEHOLDER_NAME] = "John Smith";
+  rb.placeholders.values[PLACEHOLDER_YEAR] = "2026";
+  rb.dst = malloc(strlen(dir) + 16);
+  sprintf(rb.dst, "%s/rendered", dir);
+
+  Bench bench = { .name = "compile_template", .input = input, .work = size / 1e6, .unit = "MB" };
+  run_bench(&bench, bench_compile, NULL, free_segments, &rb);
+
+  rb.tpl.items = NULL;
+  rb.tpl.size = rb.tpl.capacity = 0;
+  compile_template(&rb.tpl);
+  bench = (Bench) { .name = "render_template", .input = input, .work = size / 1e6, .unit = "MB" };
+  run_bench(&bench, bench_render, NULL, NULL, &rb);
+  remove(rb.dst);
+  free(rb.tpl.items);
+  free(rb.tpl.data);
+  free(rb.dst);
+}
+
+void write_bench_file(const char *path, const char *content, size_t len)
+{
+  make_parent_dirs((char *) path);
+  FILE *f = fopen(path, "w");
+  assert(f != NULL);
+  fwrite(content, 1, len, f);
+  fclose(f);
+}
+
+typedef struct {
+  char *cachepath;
+  char *path;
+  ConfigSource *src;
+  char *lang;
+} CacheBench;
+
+// What `boiling new` does with the config on a cache hit: load the image
+// and look keys up in `Core` and one language.
+void bench_cache_load(void *ctx, size_t i)
+{
+  (void) i;
+  CacheBench *cb = ctx;
+  Configs *confs = load_config_cache(cb->cachepath, cb->path, cb->src);
+  assert(confs != NULL);
+  int index = find_language(confs, cb->lang);
+  assert(index > 0);
+  ConfigEntry *name = get_conf_entry(confs->items[GLOBAL_CONFIG], "name");
+  ConfigEntry *src = get_conf_entry(confs->items[index], "src");
+  assert(name != NULL && src != NULL);
+  (void) name;
+  (void) src;
+  destroy_configs(confs);
+}
+
+// Config with `langs` languages of `keys` keys each, loaded from its
+// compiled cache.
+void bench_config_cache(size_t langs, size_t keys, const char *input, char *dir)
+{
+  char *config = malloc(langs * keys * 48 + 64);
+  size_t len = sprintf(config, "[Core]\nname=John Smith\ngitrepo=true\n");
+  for (size_t l = 0; l < langs; l++) {
+    len += sprintf(config + len, "\n[Language]\nname=lang%zu\nsrc=./src%zu\n", l, l);
+    for (size_t k = 0; k < keys; k++)
+      len += sprintf(config + len, "key%zu=value%zu\n", k, l);
+  }
+  char path[PATH_MAX];
+  char cachepath[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/cache.conf", dir);
+  snprintf(cachepath, sizeof(cachepath), "%s/cache.confc", dir);
+  write_bench_file(path, config, len);
+  free(config);
+
+  CacheBench cb = { .cachepath = cachepath, .path = path, .src = load_config(path), .lang = "lang0" };
+  assert(cb.src != NULL);
+  Arena scratch = { 0 };
+  Configs *confs = parse_config(lex_config(&scratch, cb.src->data, cb.src->size, NULL), NULL);
+  arena_release(&scratch);
+  int res = write_config_cache(cachepath, path, cb.src, confs);
+  assert(res == 0);
+  (void) res;
+  destroy_configs(confs);
+
+  Bench bench = { .name = "load_config_cache", .input = input, .work = 1, .unit = "loads" };
+  run_bench(&bench, bench_cache_load, NULL, NULL, &cb);
+  unload_config(cb.src);
+  remove(cachepath);
+  remove(path);
+}
+
+typedef struct {
+  char *src;
+  Placeholders placeholders;
+  char *dst;
+  IoBackend io;
+} TemplateFileBench;
+
+// Loads the template from disk, which maps it when it is large enough,
+// and renders it.
+void bench_template_file_render(void *ctx, size_t i)
+{
+  (void) i;
+  TemplateFileBench *tb = ctx;
+  Template *tpl = load_template(tb->src, true);
+  assert(tpl != NULL);
+  IoBatch batch = { 0 };
+  io_batch_template(&batch, tpl, &tb->placeholders, tb->dst, O_TRUNC, 0644);
+  submit_io_batch(&batch, tb->io);
+  assert(batch.items[0].result == 0);
+  destroy_io_batch(&batch);
+  destroy_template(tpl);
+}
+
+// Placeholders every `every` bytes; with a small `every` the render has
+// more buffers than one writev takes.
+void bench_template_file(size_t size, size_t every, const char *input, char *dir)
+{
+  // The template cache goes into the scratch directory.
+  setenv("HOME", dir, 1);
+  TemplateFileBench tb = { 0 };
+  tb.src = malloc(strlen(dir) + 16);
+  sprintf(tb.src, "%s/template", dir);
+  tb.dst = malloc(strlen(dir) + 16);
+  sprintf(tb.dst, "%s/rendered", dir);
+  char *data = generate_template(size, every);
+  write_bench_file(tb.src, data, size);
+  free(data);
+  tb.placeholders.values[PLACEHOLDER_NAME] = "John Smith";
+  tb.placeholders.values[PLACEHOLDER_YEAR] = "2026";
+
+  IoBackend backends[] = { IO_SYNC, IO_URING };
+  const char *suffixes[] = { "sync", "uring" };
+  for (size_t i = 0; i < 2; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s_%s", input, suffixes[i]);
+    tb.io = backends[i];
+    Bench bench = { .name = "load_render_template", .input = name, .work = size / 1e6, .unit = "MB" };
+    run_bench(&bench, bench_template_file_render, NULL, NULL, &tb);
+  }
+  remove(tb.src);
+  remove(tb.dst);
+  free(tb.src);
+  free(tb.dst);
+}
+
+// Template tree `depth` directories deep with `files` files per level,
+// one in four of them with placeholders, plus a vendored multi-MB asset.
+void generate_template_tree(const char *root, size_t depth, size_t files)
+{
+  char dir[PATH_MAX];
+  strcpy(dir, root);
+  char *big = generate_template(4 << 20, 4 << 20);
+  for (size_t d = 0; d < depth; d++) {
+    for (size_t f = 0; f < files; f++) {
+      char path[PATH_MAX + 32];
+      sprintf(path, "%s/file%zu.txt", dir, f);
+      const char *content = f % 4 == 0 ? "// [[Name]] [[Year]]\nint x;\n" : "static content\n";
+      write_bench_file(path, content, strlen(content));
+    }
+    strcat(dir, "/level");
+  }
+  char path[PATH_MAX];
+  sprintf(path, "%s/vendor/asset.bin", root);
+  write_bench_file(path, big, 4 << 20);
+  free(big);
+}
+
+typedef struct {
+  ScaffoldContext *scaffold;
+  char *dir;
+  char root[PATH_MAX];
+} ProjectBench;
+
+void project_path(void *ctx, size_t i)
+{
+  ProjectBench *pb = ctx;
+  snprintf(pb->root, sizeof(pb->root), "%s/project%zu", pb->dir, i);
+}
+
+void bench_project(void *ctx, size_t i)
+{
+  (void) i;
+  ProjectBench *pb = ctx;
+  int res = create_new_project(pb->scaffold, pb->root, "cpp");
+  assert(res == 0);
+  (void) res;
+}
+
+// Streams the project into an archive written to /dev/null, so only
+// producing the stream is measured.
+void bench_project_archive(void *ctx, size_t i)
+{
+  (void) i;
+  ProjectBench *pb = ctx;
+  pb->scaffold->sink.tar = open_tar_stream("/dev/null", false);
+  assert(pb->scaffold->sink.tar != NULL);
+  int res = create_new_project(pb->scaffold, pb->root, "cpp");
+  res |= close_tar_stream(pb->scaffold->sink.tar);
+  pb->scaffold->sink.tar = NULL;
+  assert(res == 0);
+  (void) res;
+}
+
+void remove_project(void *ctx, size_t i)
+{
+  (void) i;
+  ProjectBench *pb = ctx;
+  remove_tree(pb->root);
+}
+
+typedef struct {
+  Snapshot *snap;
+  ProjectBench *pb;
+} SnapshotBench;
+
+void bench_snapshot(void *ctx, size_t i)
+{
+  (void) i;
+  SnapshotBench *sb = ctx;
+  Placeholders values = { 0 };
+  resolve_year_placeholder(&values);
+  ProjectFs fs = { .fd = -1 };
+  int res = mkdir(sb->pb->root, 0777);
+  res |= open_project_fs(&fs, sb->pb->root);
+  OutputSink sink = { .io = IO_SYNC, .tar = NULL, .snapshot = NULL, .fs = &fs };
+  res |= materialize_snapshot(sb->snap, &values, sb->pb->root, &sink);
+  close_project_fs(&fs);
+  assert(res == 0);
+  (void) res;
+}
+
+void snapshot_project_path(void *ctx, size_t i)
+{
+  project_path(((SnapshotBench *) ctx)->pb, i);
+}
+
+void remove_snapshot_project(void *ctx, size_t i)
+{
+  remove_project(((SnapshotBench *) ctx)->pb, i);
+}
+
+// End-to-end scaffolding with a real config, LICENSE and template tree
+// under a fake $HOME inside `dir`.
+void bench_scaffold(char *dir)
+{
+  char home[PATH_MAX];
+  char path[PATH_MAX + 64];
+  snprintf(home, sizeof(home), "%s/home", dir);
+  size_t size;
+  char *config = generate_config(10, &size);
+  snprintf(path, sizeof(path), "%s/.config/boiling/boiling.conf", home);
+  write_bench_file(path, config, size);
+  free(config);
+  const char *license = "Copyright (c) [[Year]] [[Name]]\n\nPermission is hereby granted...\n";
+  snprintf(path, sizeof(path), "%s/.config/boiling/LICENSE", home);
+  write_bench_file(path, license, strlen(license));
+  snprintf(path, sizeof(path), "%s/.config/boiling/templates/cpp", home);
+  generate_template_tree(path, 16, 12);
+  setenv("HOME", home, 1);
+
+  Configs *confs = get_configs();
+  ScaffoldContext *scaffold = create_scaffold_context(confs);
+  assert(scaffold != NULL);
+  load_scaffold_language(scaffold, get_lang_index(confs, "cpp"));
+  ProjectBench pb = { .scaffold = scaffold, .dir = dir };
+  IoBackend backends[] = { IO_SYNC, IO_URING };
+  const char *inputs[] = { "tree_sync", "tree_uring" };
+  for (size_t i = 0; i < 2; i++) {
+    scaffold->sink.io = backends[i];
+    Bench bench = { .name = "create_new_project", .input = inputs[i], .work = 1, .unit = "projects" };
+    run_bench(&bench, bench_project, project_path, remove_project, &pb);
+  }
+  Bench archive = { .name = "create_new_project", .input = "tree_tar", .work = 1, .unit = "projects" };
+  run_bench(&archive, bench_project_archive, project_path, NULL, &pb);
+
+  // The same project stamped out of a snapshot image.
+  snprintf(path, sizeof(path), "%s/tree.snap", dir);
+  SnapshotRecorder *rec = create_snapshot_recorder(&scaffold->placeholders);
+  scaffold->sink.snapshot = rec;
+  int res = create_new_project(scaffold, dir, "cpp");
+  scaffold->sink.snapshot = NULL;
+  res |= write_snapshot(rec, path);
+  assert(res == 0);
+  destroy_snapshot_recorder(rec);
+  SnapshotBench sb = { .snap = open_snapshot(path), .pb = &pb };
+  assert(sb.snap != NULL);
+  Bench snapshot = { .name = "create_from_snapshot", .input = "tree_sync", .work = 1, .unit = "projects" };
+  run_bench(&snapshot, bench_snapshot, snapshot_project_path, remove_snapshot_project, &sb);
+  close_snapshot(sb.snap);
+  remove(path);
+  destroy_scaffold_context(scaffold);
+
+  // Static files linked from the object store instead of copied.
+  add_conf_entry(confs->items[GLOBAL_CONFIG], "store", "true");
+  scaffold = create_scaffold_context(confs);
+  assert(scaffold != NULL);
+  load_scaffold_language(scaffold, get_lang_index(confs, "cpp"));
+  pb.scaffold = scaffold;
+  Bench bench = { .name = "create_new_project", .input = "tree_store", .work = 1, .unit = "projects" };
+  run_bench(&bench, bench_project, project_path, remove_project, &pb);
+  destroy_scaffold_context(scaffold);
+  destroy_configs(confs);
+}
+
+// Scratch directory on tmpfs when there is one, so the filesystem
+// benchmarks measure boiling and not the disk.
+char *make_bench_dir()
+{
+  const char *base = is_dir("/dev/shm") ? "/dev/shm" : "/tmp";
+  char *dir = malloc(PATH_MAX);
+  snprintf(dir, PATH_MAX, "%s/boiling-bench-%ld", base, (long) getpid());
+  if (mkdir(dir, 0777) != 0) {
+    ERRORF("could not create %s: %s\n", dir, strerror(errno));
+    exit(1);
+  }
+  return dir;
+}
+
+typedef struct {
+  Hooks hooks;
+  char *dir;
+  size_t jobs;
+} HookBench;
+
+void bench_hook_round(void *ctx, size_t i)
+{
+  (void) i;
+  HookBench *hb = ctx;
+  int res = run_hooks(&hb->hooks, hb->dir, hb->jobs);
+  assert(res == 0);
+  (void) res;
+}
+
+// Spawning and reaping `count` hooks that do nothing, `jobs` at a time.
+void bench_hooks(size_t count, size_t jobs, const char *input, char *dir)
+{
+  HookBench hb = { .hooks = { 0 }, .dir = dir, .jobs = jobs };
+  for (size_t i = 0; i < count; i++) {
+    add_hook(&hb.hooks, "true", 4);
+    hb.hooks.items[i].log = malloc(strlen(dir) + 32);
+    sprintf(hb.hooks.items[i].log, "%s/hook%zu.log", dir, i);
+  }
+  Bench bench = { .name = "run_hooks", .input = input, .work = count, .unit = "hooks" };
+  run_bench(&bench, bench_hook_round, NULL, NULL, &hb);
+  for (size_t i = 0; i < count; i++)
+    remove(hb.hooks.items[i].log);
+  destroy_hooks(&hb.hooks);
+}
+
+int main()
+{
+  char *dir = make_bench_dir();
+  printf("{\"benchmarks\": [");
+
+  bench_config(10, "10_lines");
+  bench_config(1000, "1k_lines");
+  bench_config(100000, "100k_lines");
+  bench_lex_scan();
+
+  bench_conf_lookup(10, "10_keys");
+  bench_conf_lookup(1000, "1k_keys");
+  bench_conf_lookup(100000, "100k_keys");
+  bench_config_cache(16, 16, "16_langs", dir);
+  bench_config_cache(1000, 16, "1k_langs", dir);
+
+  bench_template(4 << 10, "4KB", dir);
+  bench_template(4 << 20, "4MB", dir);
+  bench_template_file(4 << 20, 1024, "4MB", dir);
+  bench_template_file(4 << 20, 16, "4MB_dense", dir);
+
+  bench_scaffold(dir);
+  bench_hooks(8, 1, "8_serial", dir);
+  bench_hooks(8, 8, "8_parallel", dir);
+
+  printf("\n]}\n");
+  remove_tree(dir);
+  free(dir);
+  return 0;
+}
@@ -1,6 +1,6 @@
 #!/usr/bin/env bash
 CC=gcc
-CFLAGS=("-Wall -Wextra -Werror -std=c99 -pedantic -ggdb3")
+CFLAGS=("-Wall -Wextra -Werror -std=c99 -pedantic -ggdb3 -pthread")
 
 SOURCES=("main.c")
 
@@ -9,6 +9,10 @@ OBJECTS=("bin/main.o")
 TARGET=boiling
 BUILD_DIR=bin/
 
+BENCH_CFLAGS=("-Wall -Wextra -Werror -std=c99 -pedantic -O2 -pthread")
+BENCH_SOURCE=bench/bench.c
+BENCH_TARGET=bin/bench
+
 build() {
   mkdir -p $BUILD_DIR 
   for ((i = 0; i < "${#SOURCES[@]}"; i++)); do
@@ -21,6 +25,12 @@ debug() {
   build
 }
 
+bench() {
+  mkdir -p $BUILD_DIR
+  $CC $BENCH_CFLAGS $BENCH_SOURCE -o $BENCH_TARGET
+  ./$BENCH_TARGET
+}
+
 case $1 in
   build)
     build
@@ -28,6 +38,9 @@ case $1 in
   debug)
     debug
     ;;
+  bench)
+    bench
+    ;;
   *)
     if [ "$1" = "" ]; then
       debug
@@ -1,18 +1,45 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <ftw.h>
+#include <glob.h>
 #include <unistd.h>
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEXER_SIMD
+#endif
+
 #define ERROR(msg) fprintf(stderr, "error: %s\n", msg)
 #define ERRORF(msg, ...) fprintf(stderr, "error: "); fprintf(stderr, msg, ##__VA_ARGS__)
 
@@ -20,26 +47,217 @@
 
 #define MAX_CONFIG_PATH 512
 
-char *trim_trailing_space(char *str)
+double now_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A finished span of the trace. `detail` is an optional owned string,
+// e.g. the project a span belongs to.
+typedef struct {
+  const char *name;
+  const char *cat;
+  char *detail;
+  double start;
+  double dur;
+  long tid;
+} TraceSpan;
+
+// Spans are only recorded once `enabled` is set by `--trace`. Until then
+// trace_begin and trace_end cost one predictable branch each.
+typedef struct {
+  bool enabled;
+  pthread_mutex_t lock;
+  TraceSpan *items;
+  size_t size;
+  size_t capacity;
+  double origin;
+} Tracer;
+
+Tracer tracer = { .enabled = false, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void start_trace()
+{
+  tracer.origin = now_seconds();
+  tracer.enabled = true;
+}
+
+double trace_begin()
+{
+  return tracer.enabled ? now_seconds() : 0;
+}
+
+void trace_end(const char *name, const char *cat, double start, const char *detail)
+{
+  if (!tracer.enabled)
+    return;
+  TraceSpan span = {
+    .name = name,
+    .cat = cat,
+    .detail = detail != NULL ? strdup(detail) : NULL,
+    .start = start,
+    .dur = now_seconds() - start,
+    .tid = syscall(SYS_gettid),
+  };
+  pthread_mutex_lock(&tracer.lock);
+  if (tracer.size >= tracer.capacity) {
+    tracer.capacity = tracer.capacity == 0 ? 64 : tracer.capacity * 2;
+    tracer.items = realloc(tracer.items, sizeof(TraceSpan) * tracer.capacity);
+  }
+  tracer.items[tracer.size++] = span;
+  pthread_mutex_unlock(&tracer.lock);
+}
+
+void write_json_string(FILE *f, const char *str)
+{
+  fputc('"', f);
+  for (; *str != '\0'; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\')
+      fprintf(f, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(f, "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+  fputc('"', f);
+}
+
+// Writes the recorded spans as complete ("X") events of the Chrome trace
+// event format, which chrome://tracing and Perfetto can open.
+int write_trace(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    return 1;
+  long pid = getpid();
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+  for (size_t i = 0; i < tracer.size; i++) {
+    TraceSpan *span = &tracer.items[i];
+    fprintf(f, "%s\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %ld, \"tid\": %ld",
+            i == 0 ? "" : ",", span->name, span->cat, (span->start - tracer.origin) * 1e6, span->dur * 1e6, pid, span->tid);
+    if (span->detail != NULL) {
+      fprintf(f, ", \"args\": {\"detail\": ");
+      write_json_string(f, span->detail);
+      fprintf(f, "}");
+    }
+    fprintf(f, "}");
+    free(span->detail);
+  }
+  fprintf(f, "\n]}\n");
+  free(tracer.items);
+  tracer.items = NULL;
+  tracer.size = tracer.capacity = 0;
+  return fclose(f) != 0;
+}
+
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+} ArenaChunk;
+
+// Bump allocator. Everything allocated from an arena is released at once
+// by `arena_release`, there is no way to free a single allocation.
+typedef struct {
+  ArenaChunk *head;
+} Arena;
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN      16
+
+size_t arena_padding(ArenaChunk *chunk)
+{
+  return -(uintptr_t) (chunk->data + chunk->used) & (ARENA_ALIGN - 1);
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+  ArenaChunk *chunk = arena->head;
+  if (chunk == NULL || chunk->used + arena_padding(chunk) + size > chunk->size) {
+    size_t chunksize = size + ARENA_ALIGN > ARENA_CHUNK_SIZE ? size + ARENA_ALIGN : ARENA_CHUNK_SIZE;
+    chunk = malloc(sizeof(ArenaChunk) + chunksize);
+    if (chunk == NULL) {
+      ERROR("Out of memory.");
+      exit(1);
+    }
+    chunk->size = chunksize;
+    chunk->used = 0;
+    // A dedicated chunk for a big allocation goes behind the current one
+    // so the free space left in the current chunk is not thrown away.
+    if (arena->head != NULL && chunksize > ARENA_CHUNK_SIZE) {
+      chunk->next = arena->head->next;
+      arena->head->next = chunk;
+    }
+    else {
+      chunk->next = arena->head;
+      arena->head = chunk;
+    }
+  }
+  chunk->used += arena_padding(chunk);
+  void *ptr = chunk->data + chunk->used;
+  chunk->used += size;
+  return ptr;
+}
+
+void *arena_calloc(Arena *arena, size_t count, size_t size)
 {
-  if (strlen(str) == 0) return str;
-  int i = strlen(str) - 1;
-  while (str[i] == ' ') i--;
-  char *res = malloc(i + 2);
-  strncpy(res, str, i + 1);
-  res[i + 1] = '\0';
+  void *ptr = arena_alloc(arena, count * size);
+  memset(ptr, 0, count * size);
+  return ptr;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+{
+  char *res = arena_alloc(arena, len + 1);
+  memcpy(res, str, len);
+  res[len] = '\0';
   return res;
 }
 
+void arena_release(Arena *arena)
+{
+  ArenaChunk *chunk = arena->head;
+  while (chunk != NULL) {
+    ArenaChunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  arena->head = NULL;
+}
+
 void help(const char *name)
 {
   printf("usage: %s <command> [<args>]\n\n", name);
   printf("The most common Boiling commands used:\n\n");
   printf("new: creates a new project in current directory\n");
   printf("  --lang | -l:     set the programming language\n");
+  printf("  --batch | -b:    create every project listed in a manifest file\n");
+  printf("  --jobs | -j:     number of projects created in parallel in batch mode, otherwise of hooks run at once\n");
+  printf("                   with parallelhooks (batch projects run their hooks one at a time)\n");
+  printf("  --io=uring|sync: submit file writes through io_uring or plain syscalls (default)\n");
+  printf("  --emit-archive <file|->: write the project as a tar archive to <file> or stdout instead of the disk\n");
+  printf("  --zstd:          compress the archive with zstd\n");
+  printf("  --from-snapshot <file>: create the project recorded in a snapshot image, without loading the config\n");
+  printf("  --set <Placeholder>=<value>: the value of a placeholder in a project created from a snapshot\n");
+  printf("  --trace <file>:  write per-phase timings as a Chrome trace to <file>\n");
   printf("config: verify the configuration of the application\n");
-  printf("  --verify | -v:   verify the syntactic and lexical correctness of the configuration file\n");
+  printf("  --verify | -v [<file|dir|glob>...]: verify the configuration file, or every given config in parallel\n");
+  printf("  --jobs | -j:     number of config files verified in parallel\n");
+  printf("  --format=json:   report every problem found by --verify as JSON on stdout\n");
   printf("  --where  | -w:   prints the config file path\n");
+  printf("  --rebuild-cache: reparse the config and rewrite the compiled config cache\n");
+  printf("  --watch:         re-verify the config every time it is saved\n");
+  printf("snapshot: record the project a language creates into an image for `new --from-snapshot`\n");
+  printf("  --lang | -l:     the language of the project\n");
+  printf("  --output | -o:   the image file to write\n");
+  printf("gc: remove the objects of the object store that no project links to\n");
+  printf("  --dry-run | -n:  only report what would be removed\n");
+  printf("serve: keep the config and templates loaded and run `new` and `config --verify` for clients\n");
+  printf("  --socket <path>: listen on <path> instead of $XDG_RUNTIME_DIR/boiling.sock\n");
 }
 
 char *find_config()
@@ -56,6 +274,16 @@ char *find_config()
   return path;
 }
 
+char *find_config_dir()
+{
+  char *path = find_config();
+  if (path == NULL)
+    return NULL;
+  char *slash = strrchr(path, '/');
+  *slash = '\0';
+  return path;
+}
+
 int handle_where_config()
 {
   char *path = find_config();
@@ -68,29 +296,46 @@ int handle_where_config()
   return 0;
 }
 
-char *load_config()
+typedef struct {
+  char *data;
+  size_t size;
+  struct timespec mtime;
+} ConfigSource;
+
+// Maps the config file into memory. The mapping is read-only and is not
+// NUL-terminated: everything that reads it must respect `size`.
+ConfigSource *load_config(char *path)
 {
-  char *path = find_config();
-  if (path == NULL)
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
     return NULL;
-
-  FILE *f = fopen(path, "r");
-  if (f == NULL)
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
     return NULL;
-  fseek(f, 0, SEEK_END);
-  int bytes = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  
-  char *config = malloc(bytes + 1);
-  char c;
-  int i = 0;
-  while ((c = getc(f)) != EOF)
-    config[i++] = c;
-  config[i] = '\0';
+  }
 
-  free(path);
-  fclose(f);
-  return config;
+  ConfigSource *src = malloc(sizeof(ConfigSource));
+  src->data = NULL;
+  src->size = st.st_size;
+  src->mtime = st.st_mtim;
+  if (src->size > 0) {
+    src->data = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (src->data == MAP_FAILED) {
+      close(fd);
+      free(src);
+      return NULL;
+    }
+  }
+  close(fd);
+  return src;
+}
+
+void unload_config(ConfigSource *src)
+{
+  if (src->data != NULL)
+    munmap(src->data, src->size);
+  free(src);
 }
 
 typedef enum {
@@ -99,38 +344,266 @@ typedef enum {
   CONFIG_SECTION,
 } ConfigTokenType;
 
+// Tokens are views into the config source: `offset` and `len` locate the
+// text inside `ConfigTokens.source`, so they stay valid only as long as
+// the source does.
 typedef struct {
   ConfigTokenType type;
-  char *value;
+  size_t offset;
+  size_t len;
 } ConfigToken;
 
 typedef struct {
   ConfigToken *items;
   size_t size;
   size_t capacity;
+  const char *source;
 } ConfigTokens;
 
-#define YIELD_TOKEN(tipe, val) (ConfigToken) { .type = tipe, .value = val }
+// A problem found in the config. `offset` points into the config source
+// and is turned into `line` and `column` (both 1-based) when the
+// diagnostics are printed. Problems without a place, like a missing
+// `Core` section, have NO_OFFSET. `seq` is the order it was reported in.
+typedef struct {
+  size_t offset;
+  size_t line;
+  size_t column;
+  size_t seq;
+  char *message;
+} Diagnostic;
+
+#define NO_OFFSET SIZE_MAX
+
+typedef struct {
+  Diagnostic *items;
+  size_t size;
+  size_t capacity;
+} Diagnostics;
+
+// Records a problem in `diags`. Passing NULL drops it, which only code
+// that has already checked the input, like the benchmarks, does.
+void report_diagnostic(Diagnostics *diags, size_t offset, const char *fmt, ...)
+{
+  if (diags == NULL)
+    return;
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(NULL, 0, fmt, args);
+  va_end(args);
+  char *message = malloc(len + 1);
+  va_start(args, fmt);
+  vsnprintf(message, len + 1, fmt, args);
+  va_end(args);
+
+  if (diags->size >= diags->capacity) {
+    diags->capacity = diags->capacity == 0 ? 16 : diags->capacity * 2;
+    diags->items = realloc(diags->items, sizeof(Diagnostic) * diags->capacity);
+  }
+  diags->items[diags->size] = (Diagnostic) { .offset = offset, .seq = diags->size, .message = message };
+  diags->size++;
+}
+
+void destroy_diagnostics(Diagnostics *diags)
+{
+  for (size_t i = 0; i < diags->size; i++)
+    free(diags->items[i].message);
+  free(diags->items);
+  diags->items = NULL;
+  diags->size = diags->capacity = 0;
+}
+
+int compare_diagnostics(const void *a, const void *b)
+{
+  const Diagnostic *x = a;
+  const Diagnostic *y = b;
+  if (x->offset != y->offset)
+    return x->offset < y->offset ? -1 : 1;
+  // Same place: keep the order they were reported in.
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// Sorts the diagnostics by place and resolves their line and column in a
+// single pass over `source`.
+void resolve_diagnostics(Diagnostics *diags, const char *source, size_t size)
+{
+  qsort(diags->items, diags->size, sizeof(Diagnostic), compare_diagnostics);
+  size_t line = 1;
+  size_t linestart = 0;
+  size_t at = 0;
+  for (size_t i = 0; i < diags->size; i++) {
+    Diagnostic *diag = &diags->items[i];
+    if (diag->offset == NO_OFFSET)
+      continue;
+    size_t offset = diag->offset < size ? diag->offset : size;
+    for (const char *nl; at < offset && (nl = memchr(source + at, '\n', offset - at)) != NULL; ) {
+      line++;
+      at = nl - source + 1;
+      linestart = at;
+    }
+    at = offset;
+    diag->line = line;
+    diag->column = offset - linestart + 1;
+  }
+}
+
+// Prints `path:line:column: error: message` lines to stderr, or one JSON
+// object to stdout with `json` set.
+void print_diagnostics(Diagnostics *diags, const char *path, bool json)
+{
+  if (json) {
+    printf("{\"file\": ");
+    write_json_string(stdout, path);
+    printf(", \"valid\": %s, \"errors\": [", diags->size == 0 ? "true" : "false");
+    for (size_t i = 0; i < diags->size; i++) {
+      Diagnostic *diag = &diags->items[i];
+      printf("%s\n  {", i == 0 ? "" : ",");
+      if (diag->offset != NO_OFFSET)
+        printf("\"line\": %zu, \"column\": %zu, ", diag->line, diag->column);
+      printf("\"message\": ");
+      write_json_string(stdout, diag->message);
+      printf("}");
+    }
+    printf("%s]}\n", diags->size == 0 ? "" : "\n");
+    return;
+  }
+  for (size_t i = 0; i < diags->size; i++) {
+    Diagnostic *diag = &diags->items[i];
+    if (diag->offset != NO_OFFSET)
+      fprintf(stderr, "%s:%zu:%zu: error: %s\n", path, diag->line, diag->column, diag->message);
+    else
+      fprintf(stderr, "%s: error: %s\n", path, diag->message);
+  }
+}
+
+#define YIELD_TOKEN(tipe, start, end) (ConfigToken) { .type = tipe, .offset = start, .len = (end) - (start) }
 #define MAX_SECTION_NAME_LEN 64
 #define MAX_KEY_NAME_LEN 256
 #define MAX_VALUE_LEN 256
 
-ConfigTokens *lex_config()
+void push_token(Arena *arena, ConfigTokens *tokens, ConfigToken token)
 {
-  char *config = load_config();
-  if (config == NULL) {
-    ERROR("Could not load config to generate new project.");
-    exit(1);
+  if (tokens->size >= tokens->capacity) {
+    ConfigToken *items = arena_alloc(arena, sizeof(ConfigToken) * tokens->capacity * 2);
+    memcpy(items, tokens->items, sizeof(ConfigToken) * tokens->size);
+    tokens->items = items;
+    tokens->capacity *= 2;
+  }
+  tokens->items[tokens->size++] = token;
+}
+
+// Every line holds at most one key/value pair, so counting newlines gives
+// a capacity that almost never has to grow.
+size_t estimate_token_count(const char *config, size_t size)
+{
+  size_t lines = 1;
+  const char *end = config + size;
+  for (const char *p = config; p < end && (p = memchr(p, '\n', end - p)) != NULL; p++)
+    lines++;
+  return lines * 2;
+}
+
+// Scanners return the index of the first `a`, `b` or `c` in
+// `data[i..size)`, or `size` when there is none. The lexer uses them to
+// jump to the next structural character of a section name or a key.
+
+typedef size_t (*LexScanner)(const char *data, size_t i, size_t size, char a, char b, char c);
+
+size_t scan_scalar(const char *data, size_t i, size_t size, char a, char b, char c)
+{
+  while (i < size && data[i] != a && data[i] != b && data[i] != c)
+    i++;
+  return i;
+}
+
+#ifdef LEXER_SIMD
+__attribute__((target("sse2")))
+size_t scan_sse2(const char *data, size_t i, size_t size, char a, char b, char c)
+{
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  __m128i vc = _mm_set1_epi8(c);
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                               _mm_cmpeq_epi8(v, vc));
+    unsigned mask = _mm_movemask_epi8(hit);
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return scan_scalar(data, i, size, a, b, c);
+}
+
+__attribute__((target("avx2")))
+size_t scan_avx2(const char *data, size_t i, size_t size, char a, char b, char c)
+{
+  __m256i va = _mm256_set1_epi8(a);
+  __m256i vb = _mm256_set1_epi8(b);
+  __m256i vc = _mm256_set1_epi8(c);
+  for (; i + 32 <= size; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+    __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)),
+                                  _mm256_cmpeq_epi8(v, vc));
+    unsigned mask = _mm256_movemask_epi8(hit);
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
   }
+  return scan_scalar(data, i, size, a, b, c);
+}
+#endif // LEXER_SIMD
+
+// Most keys are a few bytes long, so the first LEX_SCALAR_PROLOGUE bytes
+// are checked one by one before `scan` pays for its vector setup.
+#define LEX_SCALAR_PROLOGUE 16
+
+size_t scan_token(LexScanner scan, const char *data, size_t i, size_t size, char a, char b, char c)
+{
+  size_t prologue = size - i < LEX_SCALAR_PROLOGUE ? size : i + LEX_SCALAR_PROLOGUE;
+  for (; i < prologue; i++)
+    if (data[i] == a || data[i] == b || data[i] == c)
+      return i;
+  return scan(data, i, size, a, b, c);
+}
+
+// Picks the widest scanner the CPU supports. `BOILING_LEXER=scalar|sse2`
+// forces a narrower one.
+LexScanner select_lex_scanner()
+{
+  const char *forced = getenv("BOILING_LEXER");
+  if (forced != NULL && ISSTREQ(forced, "scalar"))
+    return scan_scalar;
+#ifdef LEXER_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && (forced == NULL || !ISSTREQ(forced, "sse2")))
+    return scan_avx2;
+  if (__builtin_cpu_supports("sse2"))
+    return scan_sse2;
+#endif
+  return scan_scalar;
+}
+
+// Index of the next newline at or after `i`, or `size`. Values and
+// comments only end at a newline, which memchr finds with the C library's
+// own vector code.
+size_t scan_line_end(const char *data, size_t i, size_t size)
+{
+  const char *nl = memchr(data + i, '\n', size - i);
+  return nl == NULL ? size : (size_t) (nl - data);
+}
 
-  ConfigTokens *tokens = malloc(sizeof(ConfigTokens));
-  tokens->items = malloc(sizeof(ConfigToken) * 32);
+// Every problem is reported to `diags` and lexing goes on with the next
+// line, so one pass finds all of them. Lines with problems yield no
+// tokens.
+ConfigTokens *lex_config(Arena *arena, const char *config, size_t size, Diagnostics *diags)
+{
+  LexScanner scan = select_lex_scanner();
+  ConfigTokens *tokens = arena_alloc(arena, sizeof(ConfigTokens));
+  tokens->capacity = estimate_token_count(config, size);
+  tokens->items = arena_alloc(arena, sizeof(ConfigToken) * tokens->capacity);
   tokens->size = 0;
-  tokens->capacity = 32;
+  tokens->source = config;
 
-  ConfigTokenType global_type = CONFIG_SECTION;
-  int i = 0;
-  while (config[i] != '\0') {
+  size_t i = 0;
+  while (i < size) {
     switch (config[i]) {
       case ' ':
       case '\n':
@@ -139,289 +612,517 @@ ConfigTokens *lex_config()
       } break;
 
       case '[': {
-        int start = ++i;
-        while (config[i] != ']' && config[i] != ' ' && config[i] != '\n' && config[i] != '\0')
+        size_t open = i;
+        size_t start = ++i;
+        i = scan_token(scan, config, i, size, ']', ' ', '\n');
+        if (i == size || config[i] == '\n')
+          report_diagnostic(diags, open, "Section has start but has no end.");
+        else if (config[i] == ' ')
+          report_diagnostic(diags, i, "Section name must not contain spaces.");
+        else if (i - start > MAX_SECTION_NAME_LEN - 1)
+          report_diagnostic(diags, start, "Section name is too long. Max chars: %d", MAX_SECTION_NAME_LEN);
+        else {
+          push_token(arena, tokens, YIELD_TOKEN(CONFIG_SECTION, start, i));
           i++;
-        if (config[i] == '\n' || config[i] == '\0') {
-          ERROR("Section has start but has no end.");
-          exit(1);
-        }
-        else if (config[i] == ' ') {
-          ERROR("Section name must not contain spaces.");
-          exit(1);
+          break;
         }
-
-        if (i - start > MAX_SECTION_NAME_LEN - 1) {
-          ERRORF("Section name is too long. Max chars: %d\n", MAX_SECTION_NAME_LEN);
-          exit(1);
-        }
-        char *value = malloc(MAX_SECTION_NAME_LEN);
-        strncpy(value, config + start, i - start);
-        value[i - start] = '\0';
-        if (tokens->size >= tokens->capacity) {
-          tokens->capacity *= 2;
-          tokens->items = realloc(tokens->items, sizeof(ConfigToken) * tokens->capacity);
-        }
-        tokens->items[tokens->size++] = YIELD_TOKEN(CONFIG_SECTION, value);
-        global_type = CONFIG_SECTION;
-        i++;
+        i = scan_line_end(config, i, size);
       } break;
 
       case '#': {
-        while (config[i] != '\n' && config[i] != '\0')
-          i++;
+        i = scan_line_end(config, i, size);
       } break;
 
       default: {
-        if (global_type == CONFIG_SECTION || global_type == CONFIG_VALUE) {
-          int start = i;
-          while (config[i] != '=' && config[i] != ' ' && config[i] != '\n' && config[i] != '\0')
-            i++;
-          if (config[i] == '\n' || config[i] == '\0') {
-            ERROR("configuration key but no value");
-            exit(1);
-          }
-          else if (config[i] == ' ') {
-            ERROR("Key must not contain spaces.");
-            exit(1);
-          }
-
-          if (i - start > MAX_KEY_NAME_LEN - 1) {
-            ERRORF("Key name is too long. Max chars: %d\n", MAX_KEY_NAME_LEN);
-            exit(1);
-          }
-          char *key_value = malloc(MAX_KEY_NAME_LEN);
-          strncpy(key_value, config + start, i - start);
-          key_value[i - start] = '\0';
-          if (tokens->size >= tokens->capacity) {
-            tokens->capacity *= 2;
-            tokens->items = realloc(tokens->items, sizeof(ConfigToken) * tokens->capacity);
-          }
-          tokens->items[tokens->size++] = YIELD_TOKEN(CONFIG_KEY, key_value);
-          i++;
-          if (config[i] == ' ') {
-            ERROR("There must be no space after `=` token.");
-            exit(1);
-          }
-          start = i;
-          while (config[i] != '\n' && config[i] != '\0')
-            i++;
-          if (i - start > MAX_VALUE_LEN - 1) {
-            ERRORF("Value is too long. Max chars: %d", MAX_VALUE_LEN);
-            exit(1);
-          }
-          char *val_value = malloc(MAX_VALUE_LEN);
-          strncpy(val_value, config + start, i - start);
-          val_value[i - start] = '\0';
-          char *trimmed_val_value = trim_trailing_space(val_value);
-          free(val_value);
-          if (tokens->size >= tokens->capacity) {
-            tokens->capacity *= 2;
-            tokens->items = realloc(tokens->items, sizeof(ConfigToken) * tokens->capacity);
-          }
-          tokens->items[tokens->size++] = YIELD_TOKEN(CONFIG_VALUE, trimmed_val_value);
-          global_type = CONFIG_VALUE;
-          i++;
+        size_t start = i;
+        i = scan_token(scan, config, i, size, '=', ' ', '\n');
+        size_t eq = i;
+        size_t end = i < size ? scan_line_end(config, i + 1, size) : size;
+        if (i == size || config[i] == '\n')
+          report_diagnostic(diags, start, "configuration key but no value");
+        else if (config[i] == ' ')
+          report_diagnostic(diags, i, "Key must not contain spaces.");
+        else if (i - start > MAX_KEY_NAME_LEN - 1)
+          report_diagnostic(diags, start, "Key name is too long. Max chars: %d", MAX_KEY_NAME_LEN);
+        else if (eq + 1 < size && config[eq + 1] == ' ')
+          report_diagnostic(diags, eq + 1, "There must be no space after `=` token.");
+        else if (end - (eq + 1) > MAX_VALUE_LEN - 1)
+          report_diagnostic(diags, eq + 1, "Value is too long. Max chars: %d", MAX_VALUE_LEN);
+        else {
+          push_token(arena, tokens, YIELD_TOKEN(CONFIG_KEY, start, eq));
+          size_t valend = end;
+          while (valend > eq + 1 && config[valend - 1] == ' ')
+            valend--;
+          push_token(arena, tokens, YIELD_TOKEN(CONFIG_VALUE, eq + 1, valend));
         }
+        i = i == size || config[i] == '\n' ? i : end;
       } break;
     }
   }
 
-  free(config);
   return tokens;
 }
 
+bool token_eq(ConfigTokens *tokens, ConfigToken token, const char *str)
+{
+  return strlen(str) == token.len && memcmp(tokens->source + token.offset, str, token.len) == 0;
+}
+
+// Copies the token text out of the source. Only done for the strings
+// that end up in the parsed config and have to outlive the mapping.
+char *token_dup(Arena *arena, ConfigTokens *tokens, ConfigToken token)
+{
+  return arena_strndup(arena, tokens->source + token.offset, token.len);
+}
+
+// `offset` is where the key was written in the config source, NO_OFFSET
+// for entries loaded from the cache.
 typedef struct {
   char *key;
   char *value;
-  void *next;
+  uint64_t hash;
+  size_t offset;
 } ConfigEntry;
 
+// A key value pair of the compiled config cache, as offsets into its
+// string table.
+typedef struct {
+  uint32_t key;
+  uint32_t value;
+} ConfigCacheEntry;
+
+// Open addressing table with linear probing. A slot is empty when its key
+// is NULL. `capacity` is always a power of two.
+// `offset` is where the config's section starts in the source.
+// Configs loaded from the cache start out with an empty table and their
+// `nlazy` entries in `lazy`, which the first lookup moves into the table
+// under `lock`. `lazy` is NULL once the table is complete.
 typedef struct {
-  ConfigEntry **buckets;
+  ConfigEntry *slots;
   size_t size;
   size_t capacity;
+  Arena *arena;
+  size_t offset;
+  const ConfigCacheEntry *lazy;
+  size_t nlazy;
+  char *strings;
+  pthread_mutex_t *lock;
 } Config;
 
-#define CONFIG_INIT_CAPACITY 256
+#define CONFIG_INIT_CAPACITY 16
+// Grow once the table is more than 3/4 full.
+#define CONFIG_MAX_LOAD(capacity) ((capacity) / 4 * 3)
 
+// The `Core` section is always the first config. Languages follow in the
+// order they are first seen and are found by name through the registry.
 #define GLOBAL_CONFIG 0
-#define CLANG_CONFIG  1
-#define CPP_CONFIG    2
-#define PYTHON_CONFIG 3
 
-#define TOTAL_CONFIGS 4
+// Maps a language name or alias to the index of its config.
+typedef struct {
+  const char *name;
+  uint64_t hash;
+  size_t index;
+} LanguageSlot;
+
+// Open addressing table like Config. `capacity` is a power of two.
+typedef struct {
+  LanguageSlot *slots;
+  size_t size;
+  size_t capacity;
+} LanguageRegistry;
+
+// Languages every config knows. `[Language]` sections naming one of them
+// or one of its comma-separated aliases extend it instead of adding a new
+// language.
+typedef struct {
+  const char *name;
+  const char *aliases;
+} BuiltinLanguage;
+
+const BuiltinLanguage builtin_languages[] = {
+  { "c",   "clang" },
+  { "cpp", "c++" },
+  { "py",  "python" },
+};
 
+// Configs and everything reachable from them live in `arena`, including
+// the Configs struct itself. Configs loaded from the compiled cache also
+// hold the mapped cache `image` their keys and values point into.
 typedef struct {
   Config **items;
   size_t capacity;
   size_t size;
+  LanguageRegistry langs;
+  Arena arena;
+  void *image;
+  size_t image_size;
+  pthread_mutex_t lock;
 } Configs;
 
 void add_config(Configs *confs, Config *conf)
 {
   if (confs->size >= confs->capacity) {
-    ERROR("Maximum configs limit extended.");
-    exit(1);
+    // Like the config tables, the old array stays in the arena.
+    Config **items = confs->items;
+    confs->capacity *= 2;
+    confs->items = arena_alloc(&confs->arena, sizeof(Config *) * confs->capacity);
+    memcpy(confs->items, items, sizeof(Config *) * confs->size);
   }
   confs->items[confs->size++] = conf;
 }
 
-Config *create_config()
+Config *create_config(Arena *arena)
 {
-  Config *conf = malloc(sizeof(Config));
+  Config *conf = arena_alloc(arena, sizeof(Config));
   conf->capacity = CONFIG_INIT_CAPACITY;
   conf->size = 0;
-  conf->buckets = calloc(conf->capacity, sizeof(ConfigEntry *));
+  conf->slots = arena_calloc(arena, conf->capacity, sizeof(ConfigEntry));
+  conf->arena = arena;
+  conf->offset = NO_OFFSET;
+  conf->lazy = NULL;
+  conf->nlazy = 0;
+  conf->strings = NULL;
+  conf->lock = NULL;
   return conf;
 }
 
-ConfigEntry *create_config_entry(char *key, char *value, void *next)
+// 64-bit FNV-1a.
+uint64_t hash_string(const char *str, size_t len)
 {
-  ConfigEntry *entry = malloc(sizeof(ConfigEntry));
-  entry->key = key;
-  entry->value = value;
-  entry->next = next;
-  return entry;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) str[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
 }
 
-void destroy_config_entry(ConfigEntry *entry)
+// Returns the slot holding `key` or the empty slot where it would go.
+ConfigEntry *find_conf_slot(Config *conf, const char *key, uint64_t hash)
 {
-  free(entry->key);
-  free(entry->value);
-  ConfigEntry *next = entry->next;
-  while (next != NULL)
-    destroy_config_entry(next);
-  free(entry);
+  size_t mask = conf->capacity - 1;
+  size_t i = hash & mask;
+  while (conf->slots[i].key != NULL) {
+    if (conf->slots[i].hash == hash && ISSTREQ(conf->slots[i].key, key))
+      break;
+    i = (i + 1) & mask;
+  }
+  return &conf->slots[i];
 }
 
-int add_conf_entry(Config *conf, char *key, char *value)
+void grow_config(Config *conf)
 {
-  int hash = 0;
-  for (size_t i = 0; i < strlen(key) + 1; i++)
-    hash += key[i];
-  hash %= conf->capacity;
-  if (conf->buckets[hash] == NULL)
-    conf->buckets[hash] = create_config_entry(key, value, NULL);
-  else {
-    ConfigEntry *entry = conf->buckets[hash];
-    while (entry->next != NULL) {
-      entry = entry->next;
-    }
-    entry->next = create_config_entry(key, value, NULL);
+  ConfigEntry *old = conf->slots;
+  size_t oldcapacity = conf->capacity;
+  // The old slots stay in the arena until it is released. Capacity doubles
+  // every time, so that never costs more than the live table.
+  conf->capacity *= 2;
+  conf->slots = arena_calloc(conf->arena, conf->capacity, sizeof(ConfigEntry));
+  for (size_t i = 0; i < oldcapacity; i++) {
+    if (old[i].key == NULL) continue;
+    *find_conf_slot(conf, old[i].key, old[i].hash) = old[i];
   }
+}
+
+int insert_conf_entry(Config *conf, char *key, char *value, size_t offset)
+{
+  if (conf->size + 1 > CONFIG_MAX_LOAD(conf->capacity))
+    grow_config(conf);
+  uint64_t hash = hash_string(key, strlen(key));
+  ConfigEntry *slot = find_conf_slot(conf, key, hash);
+  if (slot->key != NULL)
+    return 1;
+  slot->key = key;
+  slot->value = value;
+  slot->hash = hash;
+  slot->offset = offset;
   conf->size++;
   return 0;
 }
 
+// Builds the table of a config loaded from the cache. Project creation
+// looks keys up from several threads, so the first one to get here fills
+// the table and the others wait for it on the lock.
+void load_lazy_config(Config *conf)
+{
+  double start = trace_begin();
+  pthread_mutex_lock(conf->lock);
+  const ConfigCacheEntry *entries = conf->lazy;
+  if (entries != NULL) {
+    for (size_t i = 0; i < conf->nlazy; i++)
+      insert_conf_entry(conf, conf->strings + entries[i].key, conf->strings + entries[i].value, NO_OFFSET);
+    __atomic_store_n(&conf->lazy, NULL, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(conf->lock);
+  trace_end("load_lazy_config", "config", start, NULL);
+}
+
+void ensure_config_loaded(Config *conf)
+{
+  if (__atomic_load_n(&conf->lazy, __ATOMIC_ACQUIRE) != NULL)
+    load_lazy_config(conf);
+}
+
+// Adds `key`, written at `offset` of the source, to the config. The first
+// definition of a key wins: adding a key that is already present keeps
+// the old value and returns 1.
+int add_conf_entry_at(Config *conf, char *key, char *value, size_t offset)
+{
+  ensure_config_loaded(conf);
+  return insert_conf_entry(conf, key, value, offset);
+}
+
+int add_conf_entry(Config *conf, char *key, char *value)
+{
+  return add_conf_entry_at(conf, key, value, NO_OFFSET);
+}
+
 ConfigEntry *get_conf_entry(Config *conf, char *key)
 {
-  int hash = 0;
-  for (size_t i = 0; i < strlen(key) + 1; i++)
-    hash += key[i];
-  hash %= conf->capacity;
-  if (conf->buckets[hash] == NULL)
-    return NULL;
-  if (ISSTREQ(conf->buckets[hash]->key, key))
-    return conf->buckets[hash];
-  else {
-    ConfigEntry *entry = conf->buckets[hash]->next;
-    if (entry == NULL)
-      return NULL;
-    while (!ISSTREQ(entry->key, key)) {
-      entry = entry->next;
+  ensure_config_loaded(conf);
+  ConfigEntry *slot = find_conf_slot(conf, key, hash_string(key, strlen(key)));
+  return slot->key != NULL ? slot : NULL;
+}
+
+// Removes `key` without leaving a tombstone: the entries following it in
+// the probe sequence are shifted back so every lookup still finds them.
+int remove_conf_entry(Config *conf, char *key)
+{
+  ConfigEntry *slot = get_conf_entry(conf, key);
+  if (slot == NULL)
+    return 1;
+  size_t mask = conf->capacity - 1;
+  size_t hole = slot - conf->slots;
+  size_t i = hole;
+  for (;;) {
+    i = (i + 1) & mask;
+    if (conf->slots[i].key == NULL)
+      break;
+    size_t home = conf->slots[i].hash & mask;
+    // Move the entry into the hole unless its home lies cyclically in
+    // (hole, i], in which case it is already reachable.
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      conf->slots[hole] = conf->slots[i];
+      hole = i;
     }
-    return entry;
   }
+  conf->slots[hole].key = NULL;
+  conf->slots[hole].value = NULL;
+  conf->slots[hole].offset = NO_OFFSET;
+  conf->size--;
+  return 0;
+}
+
+// Returns the slot holding `name` or the empty slot where it would go.
+LanguageSlot *find_language_slot(LanguageRegistry *langs, const char *name, uint64_t hash)
+{
+  size_t mask = langs->capacity - 1;
+  size_t i = hash & mask;
+  while (langs->slots[i].name != NULL) {
+    if (langs->slots[i].hash == hash && ISSTREQ(langs->slots[i].name, name))
+      break;
+    i = (i + 1) & mask;
+  }
+  return &langs->slots[i];
+}
+
+// Index of the config of the language called `name` or one of its
+// aliases, -1 if there is none.
+int find_language(Configs *confs, const char *name)
+{
+  LanguageSlot *slot = find_language_slot(&confs->langs, name, hash_string(name, strlen(name)));
+  return slot->name != NULL ? (int) slot->index : -1;
+}
+
+// Makes `name` refer to the language at `index`. Returns 1 if the name
+// already refers to another language.
+int add_language_name(Configs *confs, const char *name, size_t index)
+{
+  LanguageRegistry *langs = &confs->langs;
+  if (langs->size + 1 > CONFIG_MAX_LOAD(langs->capacity)) {
+    LanguageSlot *old = langs->slots;
+    size_t oldcapacity = langs->capacity;
+    langs->capacity *= 2;
+    langs->slots = arena_calloc(&confs->arena, langs->capacity, sizeof(LanguageSlot));
+    for (size_t i = 0; i < oldcapacity; i++)
+      if (old[i].name != NULL)
+        *find_language_slot(langs, old[i].name, old[i].hash) = old[i];
+  }
+  uint64_t hash = hash_string(name, strlen(name));
+  LanguageSlot *slot = find_language_slot(langs, name, hash);
+  if (slot->name != NULL)
+    return slot->index == index ? 0 : 1;
+  slot->name = name;
+  slot->hash = hash;
+  slot->index = index;
+  langs->size++;
+  return 0;
+}
+
+// Calls `fn` with every item of a comma-separated list value, trimmed of
+// spaces. Stops and returns 1 as soon as `fn` does.
+int for_each_list_item(const char *list, int (*fn)(void *ctx, const char *item, size_t len), void *ctx)
+{
+  while (*list != '\0') {
+    while (*list == ' ')
+      list++;
+    const char *end = strchr(list, ',');
+    if (end == NULL)
+      end = list + strlen(list);
+    size_t len = end - list;
+    while (len > 0 && list[len - 1] == ' ')
+      len--;
+    if (len > 0 && fn(ctx, list, len) != 0)
+      return 1;
+    list = *end == ',' ? end + 1 : end;
+  }
+  return 0;
 }
 
-void destroy_config(Config *conf)
+typedef struct {
+  Configs *confs;
+  size_t index;
+  Diagnostics *diags;
+  size_t offset;
+  bool failed;
+} AliasContext;
+
+int add_language_alias(void *ctx, const char *alias, size_t len)
 {
-  for (size_t i = 0; i < conf->capacity; i++) {
-    ConfigEntry *entry = conf->buckets[i];
-    if (entry == NULL) continue;
-    destroy_config_entry(entry);
+  AliasContext *ac = ctx;
+  char *name = arena_strndup(&ac->confs->arena, alias, len);
+  if (add_language_name(ac->confs, name, ac->index) != 0) {
+    report_diagnostic(ac->diags, ac->offset, "alias `%s` already names another language.", name);
+    ac->failed = true;
   }
-  free(conf->buckets);
-  free(conf);
+  return 0;
+}
+
+// Registers every alias in the list. A name that already refers to
+// another language is reported and skipped. Returns 1 if there was one.
+int add_language_aliases(Configs *confs, size_t index, const char *aliases, Diagnostics *diags, size_t offset)
+{
+  AliasContext ac = { .confs = confs, .index = index, .diags = diags, .offset = offset, .failed = false };
+  for_each_list_item(aliases, add_language_alias, &ac);
+  return ac.failed;
 }
 
-bool is_known_key(char *key)
+// Adds an empty config for the language `name` and returns its index.
+size_t add_language(Configs *confs, char *name)
 {
-  return ISSTREQ(key, "name") || ISSTREQ(key, "gitrepo") ||
-    ISSTREQ(key, "src") || ISSTREQ(key, "bin");
+  Config *conf = create_config(&confs->arena);
+  add_conf_entry(conf, "name", name);
+  add_config(confs, conf);
+  add_language_name(confs, name, confs->size - 1);
+  return confs->size - 1;
 }
 
-Configs *parse_config(ConfigTokens *tokens)
+// Creates the configs with an empty `Core` config and the builtin
+// languages.
+Configs *create_configs()
 {
-  // Arena?
-  Configs *confs = malloc(sizeof(Configs));
-  confs->capacity = TOTAL_CONFIGS;
+  Arena arena = { 0 };
+  Configs *confs = arena_alloc(&arena, sizeof(Configs));
+  confs->arena = arena;
+  confs->image = NULL;
+  confs->image_size = 0;
+  pthread_mutex_init(&confs->lock, NULL);
+  confs->capacity = 8;
   confs->size = 0;
-  confs->items = malloc(sizeof(Config *) * confs->capacity);
-  Config *global = create_config();
-  add_config(confs, global);
-  Config *clang = create_config();
-  add_config(confs, clang);
-  Config *cpp = create_config();
-  add_config(confs, cpp);
-  Config *python = create_config();
-  add_config(confs, python);
+  confs->items = arena_alloc(&confs->arena, sizeof(Config *) * confs->capacity);
+  confs->langs.size = 0;
+  confs->langs.capacity = CONFIG_INIT_CAPACITY;
+  confs->langs.slots = arena_calloc(&confs->arena, confs->langs.capacity, sizeof(LanguageSlot));
+  add_config(confs, create_config(&confs->arena));
+  for (size_t i = 0; i < sizeof(builtin_languages) / sizeof(builtin_languages[0]); i++) {
+    size_t index = add_language(confs, (char *) builtin_languages[i].name);
+    add_language_aliases(confs, index, builtin_languages[i].aliases, NULL, NO_OFFSET);
+  }
+  return confs;
+}
+
+// Name the language at `index` was first defined with.
+const char *language_name(Configs *confs, size_t index)
+{
+  return get_conf_entry(confs->items[index], "name")->value;
+}
+
+void destroy_configs(Configs *confs)
+{
+  if (confs->image != NULL)
+    munmap(confs->image, confs->image_size);
+  pthread_mutex_destroy(&confs->lock);
+  // The arena header lives inside the arena, so it is copied out first.
+  Arena arena = confs->arena;
+  arena_release(&arena);
+}
+
+// Keys are checked against the schemas by the validators, so parsing
+// accepts any key and only resolves which config a section belongs to.
+// Problems are reported to `diags` and the rest of a bad section is
+// skipped, so one pass finds every problem.
+Configs *parse_config(ConfigTokens *tokens, Diagnostics *diags)
+{
+  Configs *confs = create_configs();
+  Arena *a = &confs->arena;
   
   size_t i = 0;
   size_t conf = GLOBAL_CONFIG;
+  bool skipping = false;
   while (i < tokens->size) {
     ConfigToken token = tokens->items[i];
     switch (token.type) {
       case CONFIG_SECTION: {
-        if (ISSTREQ(token.value, "Core"))
+        // The section token starts after its `[`.
+        size_t open = token.offset - 1;
+        skipping = false;
+        if (token_eq(tokens, token, "Core")) {
           conf = GLOBAL_CONFIG;
-        else if (ISSTREQ(token.value, "Language")) {
-          token = tokens->items[++i];
-          if (!ISSTREQ(token.value, "name")) {
-            ERROR("The first config entry after `Language` section must be `name`");
-            exit(1);
+          if (confs->items[conf]->offset == NO_OFFSET)
+            confs->items[conf]->offset = open;
+        }
+        else if (token_eq(tokens, token, "Language")) {
+          if (i + 2 >= tokens->size || tokens->items[i + 1].type != CONFIG_KEY ||
+              !token_eq(tokens, tokens->items[i + 1], "name")) {
+            report_diagnostic(diags, open, "The first config entry after `Language` section must be `name`");
+            skipping = true;
+            break;
           }
-          free(token.value);
-          token = tokens->items[++i];
-          char *value = token.value;
-          if (ISSTREQ(value, "clang"))
-            conf = CLANG_CONFIG;
-          else if (ISSTREQ(value, "cpp"))
-            conf = CPP_CONFIG;
-          else if (ISSTREQ(value, "py"))
-            conf = PYTHON_CONFIG;
-          else {
-            ERRORF("Unknown language `%s`\n", value);
-            exit(1);
+          i += 2;
+          char *name = token_dup(a, tokens, tokens->items[i]);
+          if (name[0] == '\0') {
+            report_diagnostic(diags, tokens->items[i - 1].offset, "Language name must not be empty.");
+            skipping = true;
+            break;
           }
-          free(token.value);
+          int index = find_language(confs, name);
+          conf = index != -1 ? (size_t) index : add_language(confs, name);
+          if (confs->items[conf]->offset == NO_OFFSET)
+            confs->items[conf]->offset = open;
         }
         else {
-          ERRORF("Unknown section name `%s`\n", token.value);
-          exit(1);
+          report_diagnostic(diags, open, "Unknown section name `%.*s`", (int) token.len, tokens->source + token.offset);
+          skipping = true;
         }
-        i++;
       } break;
 
       case CONFIG_KEY: {
-        char *key = token.value;
-        if (!is_known_key(key)) {
-          ERRORF("`%s` doesn't appear to be a known key.\n", key);
-          exit(1);
-        }
-        token = tokens->items[++i];
-        char *value = token.value;
-        add_conf_entry(confs->items[conf], key, value);
         i++;
+        if (skipping)
+          break;
+        char *key = token_dup(a, tokens, token);
+        char *value = token_dup(a, tokens, tokens->items[i]);
+        bool added = add_conf_entry_at(confs->items[conf], key, value, token.offset) == 0;
+        if (added && conf != GLOBAL_CONFIG && ISSTREQ(key, "aliases"))
+          add_language_aliases(confs, conf, value, diags, token.offset);
       } break;
 
       default: {
         assert(0 && "unreachable");
       } break;
     }
+    i++;
   }
-  free(tokens);
   return confs;
 }
 
@@ -442,394 +1143,4548 @@ bool is_dir(char *path)
   return S_ISDIR(pstat.st_mode);
 }
 
+// Creates every missing parent directory of `path`, like `mkdir -p`
+// without the last component.
+int make_parent_dirs(char *path)
+{
+  char *buf = strdup(path);
+  for (char *p = strchr(buf + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    *p = '\0';
+    if (mkdir(buf, 0777) != 0 && errno != EEXIST) {
+      free(buf);
+      return 1;
+    }
+    *p = '/';
+  }
+  free(buf);
+  return 0;
+}
+
 bool is_valid_path(char *str)
 {
   char *s = strchr(str, 0);
   return (long long int) strlen(str) == s - str;
 }
 
-bool is_valid_core_config(Config *config)
+// A conservative subset of git's ref name rules.
+bool is_valid_branch_name(char *str)
 {
-  if (config->size == 0) {
-    ERROR("`Core` must have `name` key value pair.");
+  size_t len = strlen(str);
+  if (len == 0 || str[0] == '-' || str[0] == '/' || str[0] == '.' ||
+      str[len - 1] == '/' || str[len - 1] == '.' || strstr(str, "..") != NULL ||
+      strstr(str, "//") != NULL || strstr(str, "@{") != NULL ||
+      (len >= 5 && ISSTREQ(str + len - 5, ".lock")))
     return false;
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = str[i];
+    if (c <= ' ' || c == 0x7f || strchr("~^:?*[\\", c) != NULL)
+      return false;
   }
+  return true;
+}
 
-  ConfigEntry *entry = get_conf_entry(config, "name");
-  if (entry == NULL) {
-    ERROR("no `name` specified for boiling.");
-    return false;
+typedef enum {
+  KEY_STRING,
+  KEY_BOOL,
+  KEY_PATH,
+  KEY_BRANCH,
+  KEY_LIST,
+  KEY_CHOICE,
+} KeyType;
+
+const char *key_type_names[] = {
+  [KEY_STRING] = "string",
+  [KEY_BOOL]   = "bool",
+  [KEY_PATH]   = "path",
+  [KEY_BRANCH] = "branch",
+  [KEY_LIST]   = "list",
+  [KEY_CHOICE] = "choice",
+};
+
+// One key a section may hold. `choices` lists the values of a KEY_CHOICE
+// key separated by `|`.
+typedef struct {
+  const char *key;
+  KeyType type;
+  const char *choices;
+  bool required;
+} KeySpec;
+
+const KeySpec core_schema[] = {
+  { "name",      KEY_STRING, NULL,           true },
+  { "gitrepo",   KEY_BOOL,   NULL,           false },
+  { "gitinit",   KEY_CHOICE, "builtin|exec", false },
+  { "gitbranch", KEY_BRANCH, NULL,           false },
+  { "store",     KEY_BOOL,   NULL,           false },
+};
+
+// Keys every language has. A language adds its own with
+// `keys=<key>[:<type>],...`, untyped keys being strings.
+const KeySpec language_schema[] = {
+  { "name",          KEY_STRING, NULL, true },
+  { "aliases",       KEY_LIST,   NULL, false },
+  { "keys",          KEY_LIST,   NULL, false },
+  { "src",           KEY_PATH,   NULL, false },
+  { "bin",           KEY_PATH,   NULL, false },
+  { "editable",      KEY_LIST,   NULL, false },
+  { "hook",          KEY_LIST,   NULL, false },
+  { "parallelhooks", KEY_BOOL,   NULL, false },
+};
+
+#define SCHEMA_SIZE(schema) (sizeof(schema) / sizeof(schema[0]))
+
+bool is_choice(const char *choices, const char *value)
+{
+  size_t len = strlen(value);
+  for (const char *p = choices; *p != '\0'; ) {
+    const char *end = strchr(p, '|');
+    if (end == NULL)
+      end = p + strlen(p);
+    if ((size_t) (end - p) == len && memcmp(p, value, len) == 0)
+      return true;
+    p = *end == '|' ? end + 1 : end;
+  }
+  return false;
+}
+
+bool is_valid_key_value(const char *key, KeyType type, const char *choices, char *value,
+                        Diagnostics *diags, size_t offset)
+{
+  switch (type) {
+    case KEY_STRING:
+    case KEY_LIST:
+      return true;
+    case KEY_BOOL: {
+      if (is_bool(value))
+        return true;
+      report_diagnostic(diags, offset, "`%s` expects boolean value. `%s` provided.", key, value);
+    } break;
+    case KEY_PATH: {
+      if (is_valid_path(value))
+        return true;
+      report_diagnostic(diags, offset, "`%s` is not a valid path.", value);
+    } break;
+    case KEY_BRANCH: {
+      if (is_valid_branch_name(value))
+        return true;
+      report_diagnostic(diags, offset, "`%s` is not a valid git branch name.", value);
+    } break;
+    case KEY_CHOICE: {
+      if (is_choice(choices, value))
+        return true;
+      report_diagnostic(diags, offset, "`%s` expects one of `%s`. `%s` provided.", key, choices, value);
+    } break;
+  }
+  return false;
+}
+
+const KeySpec *find_key_spec(const KeySpec *schema, size_t size, const char *key)
+{
+  for (size_t i = 0; i < size; i++)
+    if (ISSTREQ(schema[i].key, key))
+      return &schema[i];
+  return NULL;
+}
+
+// A key a language declares with `keys=`.
+typedef struct {
+  const char *key;
+  KeyType type;
+  bool found;
+  bool valid;
+  Diagnostics *diags;
+  size_t offset;
+} DeclaredKey;
+
+int find_declared_key(void *ctx, const char *item, size_t len)
+{
+  DeclaredKey *declared = ctx;
+  const char *colon = memchr(item, ':', len);
+  size_t keylen = colon != NULL ? (size_t) (colon - item) : len;
+  if (keylen != strlen(declared->key) || memcmp(item, declared->key, keylen) != 0)
+    return 0;
+  declared->found = true;
+  declared->type = KEY_STRING;
+  if (colon == NULL)
+    return 1;
+  size_t typelen = item + len - colon - 1;
+  for (size_t t = 0; t < sizeof(key_type_names) / sizeof(key_type_names[0]); t++) {
+    if (t != KEY_CHOICE && strlen(key_type_names[t]) == typelen && memcmp(colon + 1, key_type_names[t], typelen) == 0) {
+      declared->type = t;
+      return 1;
+    }
+  }
+  report_diagnostic(declared->diags, declared->offset,
+                    "`%.*s` is not a key type. Expected string, bool, path, branch or list.", (int) typelen, colon + 1);
+  declared->valid = false;
+  return 1;
+}
+
+// The single validator of every section: each key must be in the section's
+// schema, or declared by the language with `keys=`, and hold a value of its
+// type. Every problem is reported to `diags`.
+bool validate_config(Config *config, bool core, Diagnostics *diags)
+{
+  const KeySpec *schema = core ? core_schema : language_schema;
+  size_t size = core ? SCHEMA_SIZE(core_schema) : SCHEMA_SIZE(language_schema);
+  ConfigEntry *name = get_conf_entry(config, "name");
+  bool valid = true;
+  for (size_t i = 0; i < size; i++) {
+    if (schema[i].required && get_conf_entry(config, (char *) schema[i].key) == NULL) {
+      if (core)
+        report_diagnostic(diags, config->offset, "`Core` must have `%s` key value pair.", schema[i].key);
+      else
+        report_diagnostic(diags, config->offset, "language `%s` must have `%s` key value pair.",
+                          name != NULL ? name->value : "", schema[i].key);
+      valid = false;
+    }
+  }
+
+  ConfigEntry *keys = core ? NULL : get_conf_entry(config, "keys");
+  for (size_t i = 0; i < config->capacity; i++) {
+    ConfigEntry *entry = &config->slots[i];
+    if (entry->key == NULL)
+      continue;
+    const KeySpec *spec = find_key_spec(schema, size, entry->key);
+    if (spec != NULL) {
+      valid &= is_valid_key_value(entry->key, spec->type, spec->choices, entry->value, diags, entry->offset);
+      continue;
+    }
+    DeclaredKey declared = {
+      .key = entry->key,
+      .found = false,
+      .valid = true,
+      .diags = diags,
+      .offset = keys != NULL ? keys->offset : NO_OFFSET,
+    };
+    if (keys != NULL)
+      for_each_list_item(keys->value, find_declared_key, &declared);
+    if (!declared.found) {
+      if (core)
+        report_diagnostic(diags, entry->offset, "`%s` doesn't appear to be a known key.", entry->key);
+      else
+        report_diagnostic(diags, entry->offset, "`%s` doesn't appear to be a known key of language `%s`. Declare it with `keys=`.",
+                          entry->key, name != NULL ? name->value : "");
+      valid = false;
+    }
+    else if (!declared.valid || !is_valid_key_value(entry->key, declared.type, NULL, entry->value, diags, entry->offset))
+      valid = false;
+  }
+  return valid;
+}
+
+char *find_cache_dir()
+{
+  char *home = getenv("HOME");
+  if (home == NULL)
+    return NULL;
+  char *path = malloc(MAX_CONFIG_PATH);
+  snprintf(path, MAX_CONFIG_PATH, "%s/.cache/boiling", home);
+  return path;
+}
+
+char *find_config_cache()
+{
+  char *dir = find_cache_dir();
+  if (dir == NULL)
+    return NULL;
+  char *path = malloc(MAX_CONFIG_PATH);
+  snprintf(path, MAX_CONFIG_PATH, "%s/boiling.confc", dir);
+  free(dir);
+  return path;
+}
+
+// The compiled config cache is a single file laid out as
+//
+//   ConfigCacheHeader
+//   source path (path_len bytes, padded to 8)
+//   ConfigCacheSection[nconfigs]
+//   ConfigCacheEntry[nentries], grouped by config
+//   string table (NUL-terminated keys and values)
+//
+// The section table is enough to register every language, so loading the
+// cache only builds the tables of the configs that are actually looked
+// up: `Core` and the language of the project being created.
+// It is only ever read back by the same binary on the same machine, so
+// integers are stored in native byte order.
+#define CONFIG_CACHE_MAGIC   "BOILCFG"
+#define CONFIG_CACHE_VERSION 3
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t nconfigs;
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint64_t source_hash;
+  uint64_t path_len;
+  uint64_t sections_offset;
+  uint64_t nentries;
+  uint64_t entries_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+} ConfigCacheHeader;
+
+#define NO_CACHE_STRING UINT32_MAX
+
+// The entries of one config are entries[first..first+count). `name` and
+// `aliases` are string offsets, NO_CACHE_STRING when the key is missing.
+typedef struct {
+  uint32_t first;
+  uint32_t count;
+  uint32_t name;
+  uint32_t aliases;
+} ConfigCacheSection;
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t) 7)
+
+bool is_cache_fresh(ConfigCacheHeader *header, char *path, ConfigSource *src)
+{
+  if (header->source_size != src->size ||
+      header->source_mtime_sec != src->mtime.tv_sec ||
+      header->source_mtime_nsec != src->mtime.tv_nsec)
+    return false;
+  const char *cached_path = (const char *) (header + 1);
+  if (header->path_len != strlen(path) || memcmp(cached_path, path, header->path_len) != 0)
+    return false;
+  return header->source_hash == hash_string(src->data, src->size);
+}
+
+// Whether `count` items of `itemsize` bytes at `offset` fit in `size`
+// bytes, without the multiplication or the sum overflowing.
+bool is_cache_range(uint64_t offset, uint64_t count, size_t itemsize, size_t size)
+{
+  return offset <= size && count <= (size - offset) / itemsize;
+}
+
+// Loads the configs from the compiled cache at `cachepath` if it was built
+// from the current contents of `src`. Keys and values point straight into
+// the mapped image, which the returned configs keep alive.
+Configs *load_config_cache(char *cachepath, char *path, ConfigSource *src)
+{
+  int fd = open(cachepath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ConfigCacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  char *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return NULL;
+
+  ConfigCacheHeader *header = (ConfigCacheHeader *) image;
+  // The header comes from disk, so every range in it is checked against
+  // the mapping before anything is read through it.
+  if (memcmp(header->magic, CONFIG_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != CONFIG_CACHE_VERSION ||
+      header->nconfigs == 0 ||
+      !is_cache_range(sizeof(ConfigCacheHeader), header->path_len, 1, size) ||
+      !is_cache_range(header->sections_offset, header->nconfigs, sizeof(ConfigCacheSection), size) ||
+      !is_cache_range(header->entries_offset, header->nentries, sizeof(ConfigCacheEntry), size) ||
+      !is_cache_range(header->strings_offset, header->strings_size, 1, size) ||
+      header->sections_offset % sizeof(uint32_t) != 0 || header->entries_offset % sizeof(uint32_t) != 0 ||
+      header->strings_size == 0 || image[header->strings_offset + header->strings_size - 1] != '\0' ||
+      !is_cache_fresh(header, path, src)) {
+    munmap(image, size);
+    return NULL;
+  }
+
+  Configs *confs = create_configs();
+  confs->image = image;
+  confs->image_size = size;
+  // A cache written by a build with more builtin languages lacks sections
+  // for the extra ones.
+  if (header->nconfigs < confs->size) {
+    destroy_configs(confs);
+    return NULL;
+  }
+  ConfigCacheSection *sections = (ConfigCacheSection *) (image + header->sections_offset);
+  ConfigCacheEntry *entries = (ConfigCacheEntry *) (image + header->entries_offset);
+  char *strings = image + header->strings_offset;
+  // Languages beyond the builtin ones were added in index order, so their
+  // configs are recreated in the same order.
+  while (confs->size < header->nconfigs)
+    add_config(confs, create_config(&confs->arena));
+  for (size_t i = 0; i < confs->size; i++) {
+    ConfigCacheSection section = sections[i];
+    bool valid = (uint64_t) section.first + section.count <= header->nentries &&
+                 (i == GLOBAL_CONFIG || section.name < header->strings_size) &&
+                 (section.aliases == NO_CACHE_STRING || section.aliases < header->strings_size);
+    for (size_t e = 0; valid && e < section.count; e++)
+      valid = entries[section.first + e].key < header->strings_size &&
+              entries[section.first + e].value < header->strings_size;
+    if (!valid || (i != GLOBAL_CONFIG && (add_language_name(confs, strings + section.name, i) != 0 ||
+        (section.aliases != NO_CACHE_STRING &&
+         add_language_aliases(confs, i, strings + section.aliases, NULL, NO_OFFSET) != 0)))) {
+      destroy_configs(confs);
+      return NULL;
+    }
+    Config *conf = confs->items[i];
+    conf->strings = strings;
+    conf->lock = &confs->lock;
+    conf->nlazy = section.count;
+    conf->lazy = section.count > 0 ? entries + section.first : NULL;
+  }
+  return confs;
+}
+
+// Writes `data` to a temporary file next to `path` and renames it over
+// `path`, so readers never see a half-written file. Missing parent
+// directories are created.
+int write_file_atomic(char *path, const void *data, size_t size)
+{
+  make_parent_dirs(path);
+  char tmppath[MAX_CONFIG_PATH + 64];
+  snprintf(tmppath, sizeof(tmppath), "%s.%ld.%lu.tmp", path, (long) getpid(), (unsigned long) pthread_self());
+  FILE *f = fopen(tmppath, "wb");
+  if (f == NULL)
+    return 1;
+  size_t written = fwrite(data, 1, size, f);
+  if (fclose(f) != 0 || written != size || rename(tmppath, path) != 0) {
+    remove(tmppath);
+    return 1;
+  }
+  return 0;
+}
+
+// Writes the compiled image of `confs` next to the other cache files.
+int write_config_cache(char *cachepath, char *path, ConfigSource *src, Configs *confs)
+{
+  uint64_t nentries = 0;
+  uint64_t strings_size = 0;
+  for (size_t c = 0; c < confs->size; c++) {
+    Config *conf = confs->items[c];
+    for (size_t i = 0; i < conf->capacity; i++) {
+      if (conf->slots[i].key == NULL) continue;
+      nentries++;
+      strings_size += strlen(conf->slots[i].key) + strlen(conf->slots[i].value) + 2;
+    }
+  }
+  if (strings_size > UINT32_MAX)
+    return 1;
+
+  ConfigCacheHeader header = { 0 };
+  memcpy(header.magic, CONFIG_CACHE_MAGIC, sizeof(header.magic));
+  header.version = CONFIG_CACHE_VERSION;
+  header.nconfigs = confs->size;
+  header.source_size = src->size;
+  header.source_mtime_sec = src->mtime.tv_sec;
+  header.source_mtime_nsec = src->mtime.tv_nsec;
+  header.source_hash = hash_string(src->data, src->size);
+  header.path_len = strlen(path);
+  header.sections_offset = ALIGN8(sizeof(header) + header.path_len);
+  header.nentries = nentries;
+  header.entries_offset = ALIGN8(header.sections_offset + confs->size * sizeof(ConfigCacheSection));
+  header.strings_offset = ALIGN8(header.entries_offset + nentries * sizeof(ConfigCacheEntry));
+  header.strings_size = strings_size;
+
+  size_t size = header.strings_offset + strings_size;
+  char *image = calloc(1, size);
+  memcpy(image, &header, sizeof(header));
+  memcpy(image + sizeof(header), path, header.path_len);
+  ConfigCacheSection *sections = (ConfigCacheSection *) (image + header.sections_offset);
+  ConfigCacheEntry *entries = (ConfigCacheEntry *) (image + header.entries_offset);
+  char *strings = image + header.strings_offset;
+  uint32_t offset = 0;
+  uint32_t next = 0;
+  for (size_t c = 0; c < confs->size; c++) {
+    Config *conf = confs->items[c];
+    ConfigCacheSection *section = &sections[c];
+    section->first = next;
+    section->name = NO_CACHE_STRING;
+    section->aliases = NO_CACHE_STRING;
+    for (size_t i = 0; i < conf->capacity; i++) {
+      ConfigEntry *slot = &conf->slots[i];
+      if (slot->key == NULL) continue;
+      ConfigCacheEntry *entry = &entries[next++];
+      entry->key = offset;
+      offset += sprintf(strings + offset, "%s", slot->key) + 1;
+      entry->value = offset;
+      if (ISSTREQ(slot->key, "name"))
+        section->name = offset;
+      else if (ISSTREQ(slot->key, "aliases"))
+        section->aliases = offset;
+      offset += sprintf(strings + offset, "%s", slot->value) + 1;
+    }
+    section->count = next - section->first;
+  }
+
+  int res = write_file_atomic(cachepath, image, size);
+  free(image);
+  return res;
+}
+
+// Returns the parsed configs, from the compiled cache when it is up to
+// date. Otherwise the config is lexed, parsed and validated and the cache
+// is rewritten. With `rebuild` set the cache is never read. Returns NULL
+// when the config is missing or has errors, which have been reported.
+Configs *load_configs(bool rebuild)
+{
+  double start = trace_begin();
+  char *path = find_config();
+  trace_end("find_config", "config", start, NULL);
+  start = trace_begin();
+  ConfigSource *src = path != NULL ? load_config(path) : NULL;
+  trace_end("load_config", "config", start, path);
+  if (src == NULL) {
+    ERROR("Could not load config to generate new project.");
+    free(path);
+    return NULL;
+  }
+
+  char *cachepath = find_config_cache();
+  Configs *confs = NULL;
+  if (cachepath != NULL && !rebuild) {
+    start = trace_begin();
+    confs = load_config_cache(cachepath, path, src);
+    trace_end("load_config_cache", "config", start, confs != NULL ? "hit" : "miss");
+  }
+  if (confs == NULL) {
+    // Tokens are only needed until parsing is done, so they get their own
+    // arena instead of staying alive in the one owned by the configs.
+    Arena scratch = { 0 };
+    start = trace_begin();
+    Diagnostics diags = { 0 };
+    ConfigTokens *tokens = lex_config(&scratch, src->data, src->size, &diags);
+    trace_end("lex_config", "config", start, NULL);
+    start = trace_begin();
+    confs = parse_config(tokens, &diags);
+    trace_end("parse_config", "config", start, NULL);
+    arena_release(&scratch);
+    // Only valid configs reach the cache, so a hit needs no validation.
+    start = trace_begin();
+    for (size_t i = 0; i < confs->size; i++)
+      validate_config(confs->items[i], i == GLOBAL_CONFIG, &diags);
+    trace_end("validate_config", "config", start, NULL);
+    if (diags.size > 0) {
+      resolve_diagnostics(&diags, src->data, src->size);
+      print_diagnostics(&diags, path, false);
+      destroy_configs(confs);
+      confs = NULL;
+    }
+    destroy_diagnostics(&diags);
+    if (cachepath != NULL && confs != NULL) {
+      start = trace_begin();
+      write_config_cache(cachepath, path, src, confs);
+      trace_end("write_config_cache", "config", start, NULL);
+    }
+  }
+  free(cachepath);
+  free(path);
+  unload_config(src);
+  return confs;
+}
+
+// Set by `boiling serve` to the configs the daemon keeps loaded. Commands
+// it runs borrow them instead of reading the config again.
+Configs *resident_configs = NULL;
+
+Configs *get_configs()
+{
+  return resident_configs != NULL ? resident_configs : load_configs(false);
+}
+
+void put_configs(Configs *confs)
+{
+  if (confs != NULL && confs != resident_configs)
+    destroy_configs(confs);
+}
+
+typedef struct {
+  pthread_mutex_t lock;
+  size_t next;
+  size_t count;
+  void (*fn)(void *ctx, size_t index);
+  void *ctx;
+} ParallelFor;
+
+void *parallel_for_worker(void *arg)
+{
+  ParallelFor *pf = arg;
+  for (;;) {
+    pthread_mutex_lock(&pf->lock);
+    size_t index = pf->next++;
+    pthread_mutex_unlock(&pf->lock);
+    if (index >= pf->count)
+      break;
+    pf->fn(pf->ctx, index);
+  }
+  return NULL;
+}
+
+size_t default_jobs()
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t) n : 1;
+}
+
+// Calls `fn(ctx, i)` for every i in [0, count) on up to `jobs` threads.
+// Indices are handed out one by one, so uneven work balances itself.
+void parallel_for(size_t count, size_t jobs, void (*fn)(void *ctx, size_t index), void *ctx)
+{
+  ParallelFor pf = { .next = 0, .count = count, .fn = fn, .ctx = ctx };
+  pthread_mutex_init(&pf.lock, NULL);
+  if (jobs > count)
+    jobs = count;
+  pthread_t *threads = malloc(sizeof(pthread_t) * (jobs > 0 ? jobs : 1));
+  size_t started = 0;
+  for (size_t i = 1; i < jobs; i++) {
+    if (pthread_create(&threads[started], NULL, parallel_for_worker, &pf) != 0)
+      break;
+    started++;
+  }
+  // The calling thread is a worker too.
+  parallel_for_worker(&pf);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  pthread_mutex_destroy(&pf.lock);
+}
+
+// Lexes, parses and validates the config at `path` in one pass and
+// collects every problem found into `diags`. The cache is not used, its
+// entries do not know where they were written. Safe to call from several
+// threads at once.
+int verify_config_file(const char *path, Diagnostics *diags)
+{
+  ConfigSource *src = load_config((char *) path);
+  if (src == NULL) {
+    report_diagnostic(diags, NO_OFFSET, "could not read config: %s", strerror(errno));
+    return 1;
+  }
+
+  Arena scratch = { 0 };
+  ConfigTokens *tokens = lex_config(&scratch, src->data, src->size, diags);
+  Configs *confs = parse_config(tokens, diags);
+  arena_release(&scratch);
+  for (size_t i = 0; i < confs->size; i++)
+    validate_config(confs->items[i], i == GLOBAL_CONFIG, diags);
+  destroy_configs(confs);
+
+  resolve_diagnostics(diags, src->data, src->size);
+  unload_config(src);
+  return diags->size == 0 ? 0 : 1;
+}
+
+typedef struct {
+  char **items;
+  size_t size;
+  size_t capacity;
+} ConfigPaths;
+
+void push_config_path(ConfigPaths *paths, const char *path)
+{
+  if (paths->size >= paths->capacity) {
+    paths->capacity = paths->capacity == 0 ? 16 : paths->capacity * 2;
+    paths->items = realloc(paths->items, sizeof(char *) * paths->capacity);
+  }
+  paths->items[paths->size++] = strdup(path);
+}
+
+void destroy_config_paths(ConfigPaths *paths)
+{
+  for (size_t i = 0; i < paths->size; i++)
+    free(paths->items[i]);
+  free(paths->items);
+}
+
+int compare_paths(const void *a, const void *b)
+{
+  return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Adds every `*.conf` file below `dir`, in sorted order so the report
+// does not depend on directory order.
+int collect_config_files(ConfigPaths *paths, const char *dir)
+{
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    ERRORF("could not open %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+  size_t first = paths->size;
+  ConfigPaths subdirs = { 0 };
+  struct dirent *entry;
+  char path[PATH_MAX];
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int) sizeof(path))
+      continue;
+    size_t len = strlen(entry->d_name);
+    if (is_dir(path))
+      push_config_path(&subdirs, path);
+    else if (len > 5 && ISSTREQ(entry->d_name + len - 5, ".conf"))
+      push_config_path(paths, path);
+  }
+  closedir(d);
+  qsort(paths->items + first, paths->size - first, sizeof(char *), compare_paths);
+  qsort(subdirs.items, subdirs.size, sizeof(char *), compare_paths);
+  int res = 0;
+  for (size_t i = 0; i < subdirs.size && res == 0; i++)
+    res = collect_config_files(paths, subdirs.items[i]);
+  destroy_config_paths(&subdirs);
+  return res;
+}
+
+// Expands one `--verify` argument: a glob pattern, a directory searched
+// for `*.conf` files or a plain file.
+int expand_config_path(ConfigPaths *paths, const char *arg)
+{
+  if (strpbrk(arg, "*?[") != NULL) {
+    glob_t matches;
+    int res = glob(arg, 0, NULL, &matches);
+    if (res == GLOB_NOMATCH) {
+      ERRORF("`%s` matches no files.\n", arg);
+      return 1;
+    }
+    if (res != 0)
+      return 1;
+    res = 0;
+    for (size_t i = 0; i < matches.gl_pathc && res == 0; i++)
+      res = expand_config_path(paths, matches.gl_pathv[i]);
+    globfree(&matches);
+    return res;
+  }
+  if (is_dir((char *) arg))
+    return collect_config_files(paths, arg);
+  push_config_path(paths, arg);
+  return 0;
+}
+
+typedef struct {
+  ConfigPaths *paths;
+  Diagnostics *diags;
+} VerifyBatch;
+
+void verify_batch_file(void *ctx, size_t index)
+{
+  VerifyBatch *batch = ctx;
+  verify_config_file(batch->paths->items[index], &batch->diags[index]);
+}
+
+// Verifies the config files in `paths`, or the user's own config when
+// there are none, on up to `jobs` threads. Every problem of every file is
+// reported, in the order the files were given, as `file:line:column`
+// lines or as JSON.
+int handle_verify_config(ConfigPaths *paths, size_t jobs, bool json)
+{
+  bool own = paths->size == 0;
+  if (own) {
+    char *path = find_config();
+    if (path == NULL) {
+      ERROR("Could not load config to verify.");
+      return 1;
+    }
+    push_config_path(paths, path);
+    free(path);
+  }
+
+  double start = now_seconds();
+  Diagnostics *diags = calloc(paths->size, sizeof(Diagnostics));
+  VerifyBatch batch = { .paths = paths, .diags = diags };
+  parallel_for(paths->size, jobs, verify_batch_file, &batch);
+
+  size_t failed = 0;
+  size_t errors = 0;
+  if (json && !own)
+    printf("{\"files\": [");
+  for (size_t i = 0; i < paths->size; i++) {
+    if (json && !own)
+      printf("%s\n", i == 0 ? "" : ",");
+    print_diagnostics(&diags[i], paths->items[i], json);
+    failed += diags[i].size > 0;
+    errors += diags[i].size;
+    destroy_diagnostics(&diags[i]);
+  }
+  free(diags);
+  if (json && !own)
+    printf("], \"valid\": %s, \"failed\": %zu}\n", failed == 0 ? "true" : "false", failed);
+
+  if (!json) {
+    if (own && errors == 0)
+      printf("Config contains no errors.\n");
+    else if (own)
+      fprintf(stderr, "%zu error%s found.\n", errors, errors == 1 ? "" : "s");
+    else
+      printf("%zu files: %zu valid, %zu with errors (%zu errors) in %.3fs\n",
+             paths->size, paths->size - failed, failed, errors, now_seconds() - start);
+  }
+  return failed == 0 ? 0 : 1;
+}
+
+int handle_rebuild_cache()
+{
+  char *cachepath = find_config_cache();
+  if (cachepath != NULL)
+    remove(cachepath);
+  Configs *confs = load_configs(true);
+  if (confs != NULL)
+    destroy_configs(confs);
+  if (cachepath == NULL || !file_exists(cachepath)) {
+    ERROR("Could not write the config cache.");
+    free(cachepath);
+    return 1;
+  }
+  printf("Config cache rebuilt: %s\n", cachepath);
+  free(cachepath);
+  return 0;
+}
+
+// One section of the watched config: the bytes from its `[` up to the
+// next section, or the keys before the first section. Each section is
+// lexed and parsed on its own and only again when its bytes change.
+// `slot` names the config the section fills: "" for `Core`, the language
+// name for `[Language]` sections and NULL when it has no keys at all.
+// `lang` is the name a `[Language]` section was given, which may be an
+// alias declared in another section, see resolve_watch_languages.
+// `index` is that config's index in the section's own `confs`. Offsets
+// in `confs` are relative to `start`. Sections with syntax errors are not
+// `clean` and are lexed again on every change, so their errors are
+// reported every time.
+typedef struct {
+  uint64_t hash;
+  size_t start;
+  size_t len;
+  char *slot;
+  char *lang;
+  size_t index;
+  bool valid;
+  bool clean;
+  Configs *confs;
+} WatchSection;
+
+typedef struct {
+  char **items;
+  size_t size;
+  size_t capacity;
+} WatchSlots;
+
+void push_watch_slot(WatchSlots *slots, const char *slot)
+{
+  for (size_t i = 0; i < slots->size; i++)
+    if (ISSTREQ(slots->items[i], slot))
+      return;
+  if (slots->size >= slots->capacity) {
+    slots->capacity = slots->capacity == 0 ? 8 : slots->capacity * 2;
+    slots->items = realloc(slots->items, sizeof(char *) * slots->capacity);
+  }
+  slots->items[slots->size++] = strdup(slot);
+}
+
+void destroy_watch_slots(WatchSlots *slots)
+{
+  for (size_t i = 0; i < slots->size; i++)
+    free(slots->items[i]);
+  free(slots->items);
+}
+
+typedef struct {
+  WatchSection *items;
+  size_t size;
+  size_t capacity;
+} WatchSections;
+
+void destroy_watch_sections(WatchSections *sections)
+{
+  for (size_t i = 0; i < sections->size; i++) {
+    if (sections->items[i].confs != NULL)
+      destroy_configs(sections->items[i].confs);
+    free(sections->items[i].slot);
+    free(sections->items[i].lang);
+  }
+  free(sections->items);
+  sections->items = NULL;
+  sections->size = sections->capacity = 0;
+}
+
+// Splits the config where a line starts with `[`, the same place where
+// the lexer starts a section token.
+void split_watch_sections(const char *data, size_t size, WatchSections *sections, size_t **offsets)
+{
+  size_t capacity = 8;
+  *offsets = malloc(sizeof(size_t) * capacity);
+  sections->size = 0;
+  sections->capacity = 0;
+  sections->items = NULL;
+
+  size_t count = 0;
+  (*offsets)[count++] = 0;
+  for (size_t i = 0; i < size; ) {
+    size_t line = i;
+    while (i < size && (data[i] == ' ' || data[i] == '\t'))
+      i++;
+    if (i < size && data[i] == '[' && line > 0) {
+      if (count >= capacity) {
+        capacity *= 2;
+        *offsets = realloc(*offsets, sizeof(size_t) * capacity);
+      }
+      (*offsets)[count++] = line;
+    }
+    const char *nl = memchr(data + i, '\n', size - i);
+    i = nl == NULL ? size : (size_t) (nl - data) + 1;
+  }
+
+  sections->capacity = count;
+  sections->items = calloc(count, sizeof(WatchSection));
+  for (size_t i = 0; i < count; i++) {
+    size_t end = i + 1 < count ? (*offsets)[i + 1] : size;
+    sections->items[i].start = (*offsets)[i];
+    sections->items[i].len = end - (*offsets)[i];
+    sections->items[i].hash = hash_string(data + (*offsets)[i], sections->items[i].len);
+  }
+  sections->size = count;
+}
+
+char *watch_section_slot(ConfigTokens *tokens, Configs *confs, size_t *index, char **lang)
+{
+  *lang = NULL;
+  if (tokens->size == 0)
+    return NULL;
+  ConfigToken first = tokens->items[0];
+  if (first.type == CONFIG_SECTION && token_eq(tokens, first, "Language")) {
+    if (tokens->size < 3 || !token_eq(tokens, tokens->items[1], "name"))
+      return NULL;
+    ConfigToken token = tokens->items[2];
+    char *name = strndup(tokens->source + token.offset, token.len);
+    int lindex = find_language(confs, name);
+    if (lindex == -1) {
+      free(name);
+      return NULL;
+    }
+    *index = lindex;
+    *lang = name;
+    return strdup(language_name(confs, lindex));
+  }
+  if (first.type == CONFIG_SECTION && !token_eq(tokens, first, "Core"))
+    return NULL;
+  *index = GLOBAL_CONFIG;
+  return strdup("");
+}
+
+// Re-lexes the sections that are not in `prev` and re-runs the validators
+// of every slot whose sections changed. Parsed sections that did not
+// change are moved from `prev` into `next`. Returns the number of
+// sections that were lexed again and sets `failed` when one of them has
+// syntax errors, which are reported to `diags`.
+size_t reverify_watch_sections(const char *data, size_t size, WatchSections *prev, WatchSections *next,
+                               WatchSlots *slots, bool *failed, Diagnostics *diags)
+{
+  size_t *offsets;
+  split_watch_sections(data, size, next, &offsets);
+  *failed = false;
+  size_t relexed = 0;
+  bool *reused = calloc(prev->size + 1, sizeof(bool));
+  for (size_t i = 0; i < next->size; i++) {
+    WatchSection *section = &next->items[i];
+    for (size_t j = 0; j < prev->size; j++) {
+      WatchSection *old = &prev->items[j];
+      if (!reused[j] && old->clean && old->hash == section->hash && old->len == section->len) {
+        section->confs = old->confs;
+        section->slot = old->slot;
+        section->lang = old->lang;
+        section->index = old->index;
+        section->valid = old->valid;
+        section->clean = true;
+        old->confs = NULL;
+        old->slot = NULL;
+        old->lang = NULL;
+        reused[j] = true;
+        break;
+      }
+    }
+    if (section->confs != NULL)
+      continue;
+
+    relexed++;
+    Arena scratch = { 0 };
+    size_t reported = diags->size;
+    ConfigTokens *tokens = lex_config(&scratch, data + offsets[i], section->len, diags);
+    section->confs = parse_config(tokens, diags);
+    section->slot = watch_section_slot(tokens, section->confs, &section->index, &section->lang);
+    section->clean = diags->size == reported;
+    *failed |= !section->clean;
+    for (size_t d = reported; d < diags->size; d++)
+      if (diags->items[d].offset != NO_OFFSET)
+        diags->items[d].offset += offsets[i];
+    arena_release(&scratch);
+    if (section->slot != NULL)
+      push_watch_slot(slots, section->slot);
+  }
+  for (size_t j = 0; j < prev->size; j++)
+    if (!reused[j] && prev->items[j].slot != NULL)
+      push_watch_slot(slots, prev->items[j].slot);
+  free(reused);
+  free(offsets);
+  return relexed;
+}
+
+bool has_diagnostic(Diagnostics *diags, size_t offset, const char *message)
+{
+  for (size_t i = 0; i < diags->size; i++)
+    if (diags->items[i].offset == offset && ISSTREQ(diags->items[i].message, message))
+      return true;
+  return false;
+}
+
+// Sections are parsed on their own, so a section named after an alias
+// declared in another one, or an alias another section already uses, is
+// only seen here. Registers the names and aliases of every section in
+// order, the way parse_config does for the whole file, and moves each
+// section to the language it really fills. The slots of sections that
+// moved are added to `slots`. Alias conflicts not already reported by a
+// section's own parse go to `diags`. Returns false if there was one.
+bool resolve_watch_languages(WatchSections *sections, WatchSlots *slots, Diagnostics *diags)
+{
+  Configs *confs = create_configs();
+  Diagnostics found = { 0 };
+  for (size_t i = 0; i < sections->size; i++) {
+    WatchSection *section = &sections->items[i];
+    if (section->lang == NULL)
+      continue;
+    int index = find_language(confs, section->lang);
+    size_t lindex = index != -1 ? (size_t) index : add_language(confs, section->lang);
+    const char *slot = language_name(confs, lindex);
+    if (!ISSTREQ(section->slot, slot)) {
+      push_watch_slot(slots, section->slot);
+      push_watch_slot(slots, slot);
+      free(section->slot);
+      section->slot = strdup(slot);
+    }
+    ConfigEntry *aliases = get_conf_entry(section->confs->items[section->index], "aliases");
+    if (aliases != NULL && add_conf_entry(confs->items[lindex], "aliases", aliases->value) == 0)
+      add_language_aliases(confs, lindex, aliases->value, &found,
+                           aliases->offset == NO_OFFSET ? NO_OFFSET : aliases->offset + section->start);
+  }
+  for (size_t i = 0; i < found.size; i++)
+    if (!has_diagnostic(diags, found.items[i].offset, found.items[i].message))
+      report_diagnostic(diags, found.items[i].offset, "%s", found.items[i].message);
+  bool valid = found.size == 0;
+  destroy_diagnostics(&found);
+  destroy_configs(confs);
+  return valid;
+}
+
+// Validates one slot with the entries of all its sections, the first
+// definition of a key winning as it does in parse_config.
+bool validate_watch_slot(WatchSections *sections, const char *slot, Diagnostics *diags)
+{
+  Arena arena = { 0 };
+  Config *conf = create_config(&arena);
+  bool found = false;
+  for (size_t i = 0; i < sections->size; i++) {
+    WatchSection *section = &sections->items[i];
+    if (section->slot == NULL || !ISSTREQ(section->slot, slot))
+      continue;
+    found = true;
+    Config *part = section->confs->items[section->index];
+    if (conf->offset == NO_OFFSET && part->offset != NO_OFFSET)
+      conf->offset = part->offset + section->start;
+    for (size_t j = 0; j < part->capacity; j++) {
+      ConfigEntry *entry = &part->slots[j];
+      if (entry->key != NULL)
+        add_conf_entry_at(conf, entry->key, entry->value,
+                          entry->offset == NO_OFFSET ? NO_OFFSET : entry->offset + section->start);
+    }
+  }
+  // A language whose sections were all removed has nothing to check.
+  bool valid = !found && slot[0] != '\0' ? true : validate_config(conf, slot[0] == '\0', diags);
+  arena_release(&arena);
+  for (size_t i = 0; i < sections->size; i++)
+    if (sections->items[i].slot != NULL && ISSTREQ(sections->items[i].slot, slot))
+      sections->items[i].valid = valid;
+  return valid;
+}
+
+volatile sig_atomic_t watch_stopping = 0;
+
+void stop_watch(int sig)
+{
+  (void) sig;
+  watch_stopping = 1;
+}
+
+// Re-verifies the config on every save until interrupted, which is a
+// normal stop and returns 0.
+int handle_watch_config()
+{
+  char *path = find_config();
+  if (path == NULL) {
+    ERROR("Could not find the config to watch.");
+    return 1;
+  }
+  char *name = strrchr(path, '/');
+  *name = '\0';
+  int fd = inotify_init1(IN_CLOEXEC);
+  // Editors often save by renaming a new file over the old one, so the
+  // directory is watched rather than the file.
+  if (fd == -1 || inotify_add_watch(fd, path, IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+    ERRORF("could not watch %s: %s\n", path, strerror(errno));
+    free(path);
+    return 1;
+  }
+  *name++ = '/';
+  printf("Watching %s\n", path);
+  fflush(stdout);
+  // Without SA_RESTART the read below returns EINTR on a signal.
+  struct sigaction stop = { .sa_handler = stop_watch };
+  sigaction(SIGINT, &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+
+  WatchSections sections = { 0 };
+  bool core_valid = false;
+  bool changed = true;
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (!watch_stopping) {
+    if (changed) {
+      double start = now_seconds();
+      ConfigSource *src = load_config(path);
+      if (src == NULL) {
+        ERRORF("could not read %s: %s\n", path, strerror(errno));
+      }
+      else {
+        WatchSections next;
+        WatchSlots slots = { 0 };
+        Diagnostics diags = { 0 };
+        // `Core` is validated even without a section, it must exist. Slots
+        // that had errors are validated again so that their errors are
+        // reported until they are fixed.
+        if (sections.items == NULL || !core_valid)
+          push_watch_slot(&slots, "");
+        for (size_t i = 0; i < sections.size; i++)
+          if (sections.items[i].slot != NULL && !sections.items[i].valid)
+            push_watch_slot(&slots, sections.items[i].slot);
+        bool failed;
+        size_t relexed = reverify_watch_sections(src->data, src->size, &sections, &next, &slots, &failed, &diags);
+        destroy_watch_sections(&sections);
+        sections = next;
+        failed |= !resolve_watch_languages(&sections, &slots, &diags);
+        for (size_t i = 0; i < slots.size; i++) {
+          bool valid = validate_watch_slot(&sections, slots.items[i], &diags);
+          if (slots.items[i][0] == '\0')
+            core_valid = valid;
+        }
+        size_t revalidated = slots.size;
+        destroy_watch_slots(&slots);
+        resolve_diagnostics(&diags, src->data, src->size);
+        print_diagnostics(&diags, path, false);
+        destroy_diagnostics(&diags);
+        unload_config(src);
+        bool ok = !failed && core_valid;
+        for (size_t i = 0; i < sections.size && ok; i++)
+          if (sections.items[i].slot != NULL)
+            ok = sections.items[i].valid;
+        if (ok)
+          printf("Config contains no errors.");
+        else
+          printf("Config contains errors.");
+        printf(" (%zu of %zu sections lexed, %zu validated, %.3fms)\n",
+               relexed, sections.size, revalidated, (now_seconds() - start) * 1000);
+        fflush(stdout);
+      }
+    }
+
+    changed = false;
+    ssize_t n = read(fd, events, sizeof(events));
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR)
+        continue;
+      ERRORF("could not read inotify events: %s\n", strerror(errno));
+      break;
+    }
+    for (char *p = events; p < events + n; ) {
+      struct inotify_event *event = (struct inotify_event *) p;
+      if (event->len > 0 && ISSTREQ(event->name, name))
+        changed = true;
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  destroy_watch_sections(&sections);
+  close(fd);
+  free(path);
+  return watch_stopping ? 0 : 1;
+}
+
+int handle_config_command(int argc, char **argv)
+{
+  bool verified = false;
+  bool found = false;
+  bool rebuilt = false;
+  bool json = false;
+  size_t jobs = default_jobs();
+
+  // The format and the number of jobs apply to `--verify` wherever they
+  // are given, so they are looked up before any command runs.
+  for (int i = 2; i < argc; i++) {
+    if (ISSTREQ(argv[i], "--jobs") || ISSTREQ(argv[i], "-j")) {
+      if (i + 1 >= argc) {
+        ERROR("No value specified for `jobs` flag.");
+        return 1;
+      }
+      char *end;
+      long n = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || n < 1) {
+        ERRORF("`%s` is not a valid number of jobs.\n", argv[i]);
+        return 1;
+      }
+      jobs = n;
+      continue;
+    }
+    char *value = NULL;
+    if (strncmp(argv[i], "--format=", 9) == 0)
+      value = argv[i] + 9;
+    else if (ISSTREQ(argv[i], "--format")) {
+      if (i + 1 >= argc) {
+        ERROR("No value specified for `format` flag.");
+        return 1;
+      }
+      value = argv[i + 1];
+    }
+    if (value == NULL)
+      continue;
+    if (!ISSTREQ(value, "json") && !ISSTREQ(value, "text")) {
+      ERRORF("Unknown format `%s`. Expected `text` or `json`.\n", value);
+      return 1;
+    }
+    json = ISSTREQ(value, "json");
+  }
+
+  for (int i = 2; i < argc; i++) {
+    char *arg = argv[i];
+    if (arg[0] != '-') {
+      ERRORF("Unknown flag `%s`.\n", arg);
+      return 1;
+    }
+    // Skip dashes
+    arg += arg[1] == '-' ? 2 : 1;
+
+    if (ISSTREQ(arg, "format") || ISSTREQ(arg, "jobs") || ISSTREQ(arg, "j")) {
+      i++;
+    }
+    else if (strncmp(arg, "format=", 7) == 0) {
+      continue;
+    }
+    else if (ISSTREQ(arg, "verify") || ISSTREQ(arg, "v")) {
+      // Every argument up to the next flag is a file, directory or glob.
+      ConfigPaths paths = { 0 };
+      int res = 0;
+      for (; i + 1 < argc && argv[i + 1][0] != '-' && res == 0; i++)
+        res = expand_config_path(&paths, argv[i + 1]);
+      if (!verified && res == 0)
+        res = handle_verify_config(&paths, jobs, json);
+      destroy_config_paths(&paths);
+      if (res != 0)
+        return 1;
+      verified = true;
+    }
+    else if (ISSTREQ(arg, "where") || ISSTREQ(arg, "w")) {
+      if (found) continue;
+      if (handle_where_config() != 0)
+        return 1;
+      found = true;
+    }
+    else if (ISSTREQ(arg, "watch")) {
+      return handle_watch_config();
+    }
+    else if (ISSTREQ(arg, "rebuild-cache")) {
+      if (rebuilt) continue;
+      if (handle_rebuild_cache() != 0)
+        return 1;
+      rebuilt = true;
+    }
+    else {
+      ERRORF("Unknown flag `%s`.\n", arg);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#define MAX_CWD_SIZE PATH_MAX
+
+int get_lang_index(Configs *confs, char *lang)
+{
+  int index = find_language(confs, lang);
+  return index == GLOBAL_CONFIG ? -1 : index;
+}
+
+char *concat_path_file(char *path, char *file)
+{
+  if (file[0] == '/')
+    file++;
+  else if (file[0] == '.' && file[1] == '/')
+    file += 2;
+  size_t pathlen = strlen(path);
+  size_t filelen = strlen(file);
+  char *str = malloc(pathlen + filelen + 2);
+  memcpy(str, path, pathlen);
+  str[pathlen++] = '/';
+  memcpy(str + pathlen, file, filelen + 1);
+  return str;
+}
+
+typedef enum {
+  PLACEHOLDER_NAME,
+  PLACEHOLDER_YEAR,
+  TOTAL_PLACEHOLDERS,
+} PlaceholderId;
+
+const char *placeholder_names[TOTAL_PLACEHOLDERS] = {
+  [PLACEHOLDER_NAME] = "Name",
+  [PLACEHOLDER_YEAR] = "Year",
+};
+
+#define LITERAL_SEGMENT UINT32_MAX
+
+// A compiled template is the list of its segments: literal spans of the
+// source text and `[[...]]` placeholders that are filled in on render.
+typedef struct {
+  uint32_t placeholder;
+  uint32_t len;
+  uint64_t offset;
+} TemplateSegment;
+
+typedef struct {
+  TemplateSegment *items;
+  size_t size;
+  size_t capacity;
+  char *data;
+  size_t datasize;
+  bool mapped;
+  struct timespec mtime;
+  // SHA-256 of the text, only computed for static templates that go
+  // into the object store.
+  bool hashed;
+  uint8_t digest[32];
+} Template;
+
+// Placeholder values, resolved once per run and shared by every render.
+typedef struct {
+  char *values[TOTAL_PLACEHOLDERS];
+  char year[16];
+} Placeholders;
+
+void push_segment(Template *tpl, uint32_t placeholder, uint64_t offset, uint64_t len)
+{
+  if (len == 0 && placeholder == LITERAL_SEGMENT)
+    return;
+  if (tpl->size >= tpl->capacity) {
+    tpl->capacity = tpl->capacity == 0 ? 16 : tpl->capacity * 2;
+    tpl->items = realloc(tpl->items, sizeof(TemplateSegment) * tpl->capacity);
+  }
+  tpl->items[tpl->size++] = (TemplateSegment) { .placeholder = placeholder, .len = len, .offset = offset };
+}
+
+// Returns the placeholder `text` starts with, closed by `]]`, or
+// LITERAL_SEGMENT when it starts with none.
+uint32_t match_placeholder(const char *text, size_t size)
+{
+  for (uint32_t p = 0; p < TOTAL_PLACEHOLDERS; p++) {
+    size_t len = strlen(placeholder_names[p]);
+    if (size >= len + 2 && memcmp(text, placeholder_names[p], len) == 0 && text[len] == ']' && text[len + 1] == ']')
+      return p;
+  }
+  return LITERAL_SEGMENT;
+}
+
+// Splits the template text into segments. Only `[[Name]]` and
+// `[[Year]]` are placeholders: any other `[[`, like C++ attributes, TOML
+// tables or CMake block comments, is literal text. Literal spans longer
+// than UINT32_MAX are split in several segments.
+void compile_template(Template *tpl)
+{
+  const char *data = tpl->data;
+  size_t size = tpl->datasize;
+  size_t literal = 0;
+  size_t i = 0;
+  while (i < size) {
+    const char *open = memchr(data + i, '[', size - i);
+    if (open == NULL)
+      break;
+    i = open - data;
+    size_t start = i + 2;
+    uint32_t id = start <= size && data[i + 1] == '[' ? match_placeholder(data + start, size - start) : LITERAL_SEGMENT;
+    if (id == LITERAL_SEGMENT) {
+      i++;
+      continue;
+    }
+    size_t end = start + strlen(placeholder_names[id]);
+    for (; i - literal > UINT32_MAX; literal += UINT32_MAX)
+      push_segment(tpl, LITERAL_SEGMENT, literal, UINT32_MAX);
+    push_segment(tpl, LITERAL_SEGMENT, literal, i - literal);
+    push_segment(tpl, id, start, end - start);
+    i = end + 2;
+    literal = i;
+  }
+  for (; size - literal > UINT32_MAX; literal += UINT32_MAX)
+    push_segment(tpl, LITERAL_SEGMENT, literal, UINT32_MAX);
+  push_segment(tpl, LITERAL_SEGMENT, literal, size - literal);
+}
+
+// SHA-256 (FIPS 180-4), the address of a file in the object store.
+typedef struct {
+  uint32_t state[8];
+  uint64_t len;
+  uint8_t block[64];
+  size_t used;
+} Sha256;
+
+const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(Sha256 *sha)
+{
+  const uint32_t init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memcpy(sha->state, init, sizeof(init));
+  sha->len = 0;
+  sha->used = 0;
+}
+
+void sha256_compress(Sha256 *sha, const uint8_t *block)
+{
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 |
+           (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = sha->state[0], b = sha->state[1], c = sha->state[2], d = sha->state[3];
+  uint32_t e = sha->state[4], f = sha->state[5], g = sha->state[6], h = sha->state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  sha->state[0] += a; sha->state[1] += b; sha->state[2] += c; sha->state[3] += d;
+  sha->state[4] += e; sha->state[5] += f; sha->state[6] += g; sha->state[7] += h;
+}
+
+void sha256_update(Sha256 *sha, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  sha->len += len;
+  if (sha->used > 0) {
+    size_t n = 64 - sha->used < len ? 64 - sha->used : len;
+    memcpy(sha->block + sha->used, p, n);
+    sha->used += n;
+    p += n;
+    len -= n;
+    if (sha->used < 64)
+      return;
+    sha256_compress(sha, sha->block);
+    sha->used = 0;
+  }
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_compress(sha, p);
+  memcpy(sha->block, p, len);
+  sha->used = len;
+}
+
+void sha256_final(Sha256 *sha, uint8_t digest[32])
+{
+  uint64_t bits = sha->len * 8;
+  uint8_t pad[72] = { 0x80 };
+  size_t padlen = sha->used < 56 ? 56 - sha->used : 120 - sha->used;
+  for (int i = 0; i < 8; i++)
+    pad[padlen + i] = bits >> (56 - i * 8);
+  sha256_update(sha, pad, padlen + 8);
+  for (int i = 0; i < 8; i++) {
+    digest[i * 4]     = sha->state[i] >> 24;
+    digest[i * 4 + 1] = sha->state[i] >> 16;
+    digest[i * 4 + 2] = sha->state[i] >> 8;
+    digest[i * 4 + 3] = sha->state[i];
+  }
+}
+
+// Compiled templates are cached in ~/.cache/boiling/templates, one file
+// per template path, laid out as
+//
+//   TemplateCacheHeader
+//   template path (path_len bytes, padded to 8)
+//   TemplateSegment[nsegments]
+//
+// A cache file is used only while the template's size and mtime match.
+// The digest of a static template is kept once it has been computed.
+#define TEMPLATE_CACHE_MAGIC   "BOILTPL"
+#define TEMPLATE_CACHE_VERSION 2
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t hashed;
+  uint64_t nsegments;
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+  uint64_t path_len;
+  uint8_t digest[32];
+} TemplateCacheHeader;
+
+char *find_template_cache(const char *path)
+{
+  char *dir = find_cache_dir();
+  if (dir == NULL)
+    return NULL;
+  char *cachepath = malloc(MAX_CONFIG_PATH);
+  snprintf(cachepath, MAX_CONFIG_PATH, "%s/templates/%016llx.tplc", dir,
+           (unsigned long long) hash_string(path, strlen(path)));
+  free(dir);
+  return cachepath;
+}
+
+int load_template_cache(Template *tpl, const char *cachepath, const char *path, struct stat *st)
+{
+  FILE *f = fopen(cachepath, "rb");
+  if (f == NULL)
+    return 1;
+  TemplateCacheHeader header;
+  char cached_path[MAX_CONFIG_PATH];
+  size_t path_len = strlen(path);
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, TEMPLATE_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TEMPLATE_CACHE_VERSION ||
+      header.source_size != (uint64_t) st->st_size ||
+      header.source_mtime_sec != st->st_mtim.tv_sec ||
+      header.source_mtime_nsec != st->st_mtim.tv_nsec ||
+      header.path_len != path_len || path_len >= MAX_CONFIG_PATH ||
+      fread(cached_path, 1, ALIGN8(path_len), f) != ALIGN8(path_len) ||
+      memcmp(cached_path, path, path_len) != 0) {
+    fclose(f);
+    return 1;
+  }
+  tpl->hashed = header.hashed != 0;
+  memcpy(tpl->digest, header.digest, sizeof(tpl->digest));
+  tpl->items = malloc(sizeof(TemplateSegment) * (header.nsegments > 0 ? header.nsegments : 1));
+  tpl->capacity = header.nsegments;
+  tpl->size = fread(tpl->items, sizeof(TemplateSegment), header.nsegments, f);
+  fclose(f);
+  for (size_t i = 0; i < tpl->size; i++) {
+    if (tpl->items[i].offset + tpl->items[i].len > tpl->datasize ||
+        (tpl->items[i].placeholder != LITERAL_SEGMENT && tpl->items[i].placeholder >= TOTAL_PLACEHOLDERS))
+      tpl->size = 0;
+  }
+  if (tpl->size != header.nsegments) {
+    free(tpl->items);
+    tpl->items = NULL;
+    tpl->size = tpl->capacity = 0;
+    return 1;
+  }
+  return 0;
+}
+
+int write_template_cache(Template *tpl, const char *cachepath, const char *path, struct stat *st)
+{
+  TemplateCacheHeader header = { 0 };
+  memcpy(header.magic, TEMPLATE_CACHE_MAGIC, sizeof(header.magic));
+  header.version = TEMPLATE_CACHE_VERSION;
+  header.nsegments = tpl->size;
+  header.source_size = st->st_size;
+  header.source_mtime_sec = st->st_mtim.tv_sec;
+  header.source_mtime_nsec = st->st_mtim.tv_nsec;
+  header.path_len = strlen(path);
+  header.hashed = tpl->hashed;
+  memcpy(header.digest, tpl->digest, sizeof(header.digest));
+
+  size_t segments_offset = ALIGN8(sizeof(header) + header.path_len);
+  size_t size = segments_offset + sizeof(TemplateSegment) * tpl->size;
+  char *image = calloc(1, size);
+  memcpy(image, &header, sizeof(header));
+  memcpy(image + sizeof(header), path, header.path_len);
+  memcpy(image + segments_offset, tpl->items, sizeof(TemplateSegment) * tpl->size);
+  int res = write_file_atomic((char *) cachepath, image, size);
+  free(image);
+  return res;
+}
+
+void destroy_template(Template *tpl)
+{
+  free(tpl->items);
+  if (tpl->mapped)
+    munmap(tpl->data, tpl->datasize);
+  else
+    free(tpl->data);
+  free(tpl);
+}
+
+// Templates at least this large are mapped instead of read. Smaller
+// ones are cheaper to read than to fault in page by page.
+#define TEMPLATE_MAP_THRESHOLD (64 * 1024)
+
+// Literal segments of a rendered template point straight into its text,
+// so with a mapped template writev copies the literal text from the page
+// cache and boiling never holds a copy of it.
+int read_template_data(Template *tpl, int fd)
+{
+  if (tpl->datasize >= TEMPLATE_MAP_THRESHOLD) {
+    void *data = mmap(NULL, tpl->datasize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+      return 1;
+    madvise(data, tpl->datasize, MADV_SEQUENTIAL);
+    tpl->data = data;
+    tpl->mapped = true;
+    return 0;
+  }
+  tpl->data = malloc(tpl->datasize > 0 ? tpl->datasize : 1);
+  size_t done = 0;
+  while (done < tpl->datasize) {
+    ssize_t n = pread(fd, tpl->data + done, tpl->datasize - done, done);
+    if (n <= 0)
+      return 1;
+    done += n;
+  }
+  return 0;
+}
+
+int read_template_file(Template *tpl, const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 1;
+  int res = read_template_data(tpl, fd);
+  close(fd);
+  return res;
+}
+
+bool is_static_template(Template *tpl)
+{
+  for (size_t i = 0; i < tpl->size; i++)
+    if (tpl->items[i].placeholder != LITERAL_SEGMENT)
+      return false;
+  return true;
+}
+
+// Compiles the template at `path`, reusing the compiled segments from
+// the cache when the template has not changed. The text itself is only
+// read when it has to be compiled, or when `withdata` is set and the
+// template has placeholders, so static files are never read here.
+Template *load_template(const char *path, bool withdata)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  Template *tpl = calloc(1, sizeof(Template));
+  tpl->datasize = st.st_size;
+  tpl->mtime = st.st_mtim;
+  char *cachepath = find_template_cache(path);
+  if (cachepath == NULL || load_template_cache(tpl, cachepath, path, &st) != 0) {
+    if (read_template_data(tpl, fd) != 0) {
+      close(fd);
+      free(cachepath);
+      destroy_template(tpl);
+      return NULL;
+    }
+    compile_template(tpl);
+    if (cachepath != NULL)
+      write_template_cache(tpl, cachepath, path, &st);
+  }
+  free(cachepath);
+  if (withdata && tpl->data == NULL && !is_static_template(tpl) && read_template_data(tpl, fd) != 0) {
+    close(fd);
+    destroy_template(tpl);
+    return NULL;
+  }
+  close(fd);
+  return tpl;
+}
+
+// Computes the SHA-256 of the template at `path` and records it in the
+// template cache, so a file is only hashed again once it changes.
+// Fails when the file changed since the template was loaded.
+int hash_template(Template *tpl, const char *path)
+{
+  if (tpl->hashed)
+    return 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size != tpl->datasize ||
+      st.st_mtim.tv_sec != tpl->mtime.tv_sec || st.st_mtim.tv_nsec != tpl->mtime.tv_nsec) {
+    close(fd);
+    return 1;
+  }
+
+  Sha256 sha;
+  sha256_init(&sha);
+  char buf[64 * 1024];
+  size_t total = 0;
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    sha256_update(&sha, buf, n);
+    total += n;
+  }
+  close(fd);
+  if (n < 0 || total != tpl->datasize)
+    return 1;
+  sha256_final(&sha, tpl->digest);
+  tpl->hashed = true;
+
+  char *cachepath = find_template_cache(path);
+  if (cachepath != NULL)
+    write_template_cache(tpl, cachepath, path, &st);
+  free(cachepath);
+  return 0;
+}
+
+// A directory fd of a project, cached by its path relative to the root.
+typedef struct {
+  char *path;
+  uint64_t hash;
+  int fd;
+} DirSlot;
+
+// A project directory held open while the project is written to disk.
+// Paths inside it are opened from the fd of their parent directory
+// instead of from the cwd, so every call resolves one component rather
+// than the whole path. Parents are opened with O_PATH the first time a
+// path below them is used and kept in `dirs`, an open addressing table
+// like Config, so a deep tree costs one lookup per directory. The
+// actions of a project share it, `lock` guards the table.
+typedef struct {
+  int fd;
+  pthread_mutex_t lock;
+  DirSlot *dirs;
+  size_t size;
+  size_t capacity;
+} ProjectFs;
+
+// Directory fds one project keeps open at most, so that batches of
+// projects stay well below the open file limit. Paths below the rest are
+// resolved from the deepest cached parent.
+#define PROJECT_FS_MAX_DIRS 64
+#define PROJECT_FS_SLOTS    128
+
+// Returns 0 or a negated errno.
+int open_project_fs(ProjectFs *fs, const char *root)
+{
+  int fd = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+  *fs = (ProjectFs) { .fd = fd, .dirs = NULL, .size = 0, .capacity = 0 };
+  pthread_mutex_init(&fs->lock, NULL);
+  return 0;
+}
+
+void close_project_fs(ProjectFs *fs)
+{
+  if (fs->fd < 0)
+    return;
+  for (size_t i = 0; i < fs->capacity; i++) {
+    if (fs->dirs[i].path == NULL) continue;
+    close(fs->dirs[i].fd);
+    free(fs->dirs[i].path);
+  }
+  free(fs->dirs);
+  close(fs->fd);
+  pthread_mutex_destroy(&fs->lock);
+  fs->fd = -1;
+}
+
+// Returns the slot of the directory named by the first `len` bytes of
+// `path` or the empty slot where it would go.
+DirSlot *find_dir_slot(ProjectFs *fs, const char *path, size_t len, uint64_t hash)
+{
+  size_t mask = fs->capacity - 1;
+  size_t i = hash & mask;
+  while (fs->dirs[i].path != NULL) {
+    if (fs->dirs[i].hash == hash && strncmp(fs->dirs[i].path, path, len) == 0 && fs->dirs[i].path[len] == '\0')
+      break;
+    i = (i + 1) & mask;
+  }
+  return &fs->dirs[i];
+}
+
+// Sets `dirfd` to the directory `path`, relative to the root, is opened
+// from and points `name` at the rest of the path below it. With `open`
+// the parents that are not cached yet are opened on the way down, so
+// `name` is a single component. Without it only cached parents are used,
+// for paths whose parents are created in the same batch. Returns 0 or
+// the negated errno of a parent that cannot be opened.
+int resolve_project_path(ProjectFs *fs, const char *path, int *dirfd, const char **name, bool open)
+{
+  *dirfd = fs->fd;
+  *name = path;
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL)
+    return 0;
+  pthread_mutex_lock(&fs->lock);
+  if (fs->capacity == 0) {
+    fs->capacity = PROJECT_FS_SLOTS;
+    fs->dirs = calloc(fs->capacity, sizeof(DirSlot));
+  }
+  int res = 0;
+  DirSlot *slot = find_dir_slot(fs, path, slash - path, hash_string(path, slash - path));
+  if (slot->path != NULL) {
+    *dirfd = slot->fd;
+    *name = slash + 1;
+  }
+  for (const char *end = strchr(path, '/'); slot->path == NULL && end != NULL; end = strchr(end + 1, '/')) {
+    size_t len = end - *name;
+    if (len == 0) {
+      *name = end + 1;
+      continue;
+    }
+    uint64_t hash = hash_string(path, end - path);
+    DirSlot *dir = find_dir_slot(fs, path, end - path, hash);
+    if (dir->path == NULL) {
+      if (!open || fs->size >= PROJECT_FS_MAX_DIRS)
+        break;
+      char component[NAME_MAX + 1];
+      if (len > NAME_MAX) {
+        res = -ENAMETOOLONG;
+        break;
+      }
+      memcpy(component, *name, len);
+      component[len] = '\0';
+      int fd = openat(*dirfd, component, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0) {
+        // Out of descriptors the rest of the path is left to the kernel.
+        if (errno != EMFILE && errno != ENFILE)
+          res = -errno;
+        break;
+      }
+      *dir = (DirSlot) { .path = strndup(path, end - path), .hash = hash, .fd = fd };
+      fs->size++;
+    }
+    *dirfd = dir->fd;
+    *name = end + 1;
+  }
+  pthread_mutex_unlock(&fs->lock);
+  return res;
+}
+
+// Removes the file or empty directory at `path`, relative to the root,
+// like remove(3).
+int remove_project_path(ProjectFs *fs, const char *path)
+{
+  int dirfd;
+  const char *name;
+  int res = resolve_project_path(fs, path, &dirfd, &name, true);
+  if (res != 0) {
+    errno = -res;
+    return -1;
+  }
+  if (unlinkat(dirfd, name, 0) == 0)
+    return 0;
+  return errno == EISDIR ? unlinkat(dirfd, name, AT_REMOVEDIR) : -1;
+}
+
+typedef enum {
+  IO_SYNC,
+  IO_URING,
+} IoBackend;
+
+typedef enum {
+  IO_OP_MKDIR,
+  IO_OP_WRITE,
+} IoOpType;
+
+// A filesystem operation of a batch. `result` is 0 or a negated errno
+// once the batch has been submitted. `path` is relative to the project
+// root and opened as `name` relative to `dirfd`, which the batch
+// resolves right before the call.
+typedef struct {
+  IoOpType type;
+  char *path;
+  int dirfd;
+  const char *name;
+  mode_t mode;
+  int flags;
+  struct iovec *iov;
+  int iovcnt;
+  size_t len;
+  int result;
+} IoOp;
+
+// Operations are submitted together. Directories are created first, in
+// the order they were added, so parents must be added before children.
+// Files are written afterwards in no particular order. Paths are resolved
+// from the directory fds of `fs`, or from the cwd when it is NULL.
+typedef struct {
+  IoOp *items;
+  size_t size;
+  size_t capacity;
+  ProjectFs *fs;
+} IoBatch;
+
+IoOp *push_io_op(IoBatch *batch, IoOpType type, const char *path, mode_t mode)
+{
+  if (batch->size >= batch->capacity) {
+    batch->capacity = batch->capacity == 0 ? 16 : batch->capacity * 2;
+    batch->items = realloc(batch->items, sizeof(IoOp) * batch->capacity);
+  }
+  IoOp *op = &batch->items[batch->size++];
+  *op = (IoOp) { .type = type, .path = strdup(path), .dirfd = AT_FDCWD, .mode = mode, .result = 0 };
+  op->name = op->path;
+  return op;
+}
+
+void io_batch_mkdir(IoBatch *batch, const char *path, mode_t mode)
+{
+  push_io_op(batch, IO_OP_MKDIR, path, mode);
+}
+
+// Queues a write of the `iov` buffers to `path`, opened with `flags`
+// (O_EXCL or O_TRUNC). The batch takes ownership of `iov`, the buffers
+// it points to must stay alive until the batch is submitted.
+void io_batch_write(IoBatch *batch, const char *path, int flags, mode_t mode, struct iovec *iov, int iovcnt)
+{
+  IoOp *op = push_io_op(batch, IO_OP_WRITE, path, mode);
+  op->flags = O_WRONLY | O_CREAT | O_CLOEXEC | flags;
+  op->iov = iov;
+  op->iovcnt = iovcnt;
+  op->len = 0;
+  for (int i = 0; i < iovcnt; i++)
+    op->len += iov[i].iov_len;
+}
+
+void destroy_io_batch(IoBatch *batch)
+{
+  for (size_t i = 0; i < batch->size; i++) {
+    free(batch->items[i].path);
+    free(batch->items[i].iov);
+  }
+  free(batch->items);
+  batch->items = NULL;
+  batch->size = batch->capacity = 0;
+}
+
+// Writes all of `iov` to `fd`, in chunks of at most IOV_MAX buffers and
+// resuming after short writes.
+int write_all_iov(int fd, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0) {
+    int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+    ssize_t written = writev(fd, iov, n);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return 1;
+    }
+    while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (written > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+int write_all(int fd, const void *data, size_t size)
+{
+  struct iovec iov = { .iov_base = (void *) data, .iov_len = size };
+  return write_all_iov(fd, &iov, 1);
+}
+
+// Points the op at its parent directory in the project of the batch, see
+// resolve_project_path. Returns 1, with the error stored in the op, when
+// the parent cannot be opened.
+int resolve_io_op(IoBatch *batch, IoOp *op, bool open)
+{
+  if (batch->fs == NULL)
+    return 0;
+  int res = resolve_project_path(batch->fs, op->path, &op->dirfd, &op->name, open);
+  if (res != 0) {
+    op->result = res;
+    return 1;
+  }
+  return 0;
+}
+
+void submit_io_op_sync(IoOp *op)
+{
+  if (op->type == IO_OP_MKDIR) {
+    op->result = mkdirat(op->dirfd, op->name, op->mode) == 0 ? 0 : -errno;
+    return;
+  }
+  int fd = openat(op->dirfd, op->name, op->flags, op->mode);
+  if (fd < 0) {
+    op->result = -errno;
+    return;
+  }
+  // write_all_iov advances the buffers, so it works on a copy.
+  struct iovec *iov = malloc(sizeof(struct iovec) * (op->iovcnt > 0 ? op->iovcnt : 1));
+  memcpy(iov, op->iov, sizeof(struct iovec) * op->iovcnt);
+  op->result = write_all_iov(fd, iov, op->iovcnt) == 0 ? 0 : -errno;
+  free(iov);
+  if (close(fd) != 0 && op->result == 0)
+    op->result = -errno;
+}
+
+// The io_uring backend talks to the kernel directly, boiling does not
+// depend on liburing.
+#define IO_RING_ENTRIES 256
+// Number of files open at once: every file is an openat -> writev ->
+// close chain on a registered file slot.
+#define IO_RING_FILES   64
+
+typedef struct {
+  int fd;
+  void *sqring;
+  size_t sqringsize;
+  void *cqring;
+  size_t cqringsize;
+  struct io_uring_sqe *sqes;
+  size_t sqessize;
+  unsigned *sqtail;
+  unsigned sqmask;
+  unsigned *sqarray;
+  unsigned *cqhead;
+  unsigned *cqtail;
+  unsigned cqmask;
+  struct io_uring_cqe *cqes;
+  unsigned entries;
+  unsigned pending;
+} IoRing;
+
+void destroy_io_ring(IoRing *ring)
+{
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqessize);
+  if (ring->cqring != NULL && ring->cqring != MAP_FAILED)
+    munmap(ring->cqring, ring->cqringsize);
+  if (ring->sqring != NULL && ring->sqring != MAP_FAILED)
+    munmap(ring->sqring, ring->sqringsize);
+  close(ring->fd);
+}
+
+// Rings set up fine on kernels that lack some of the opcodes the batches
+// use, which would then fail every operation with EINVAL. MKDIRAT came
+// with the same kernel (5.15) as openat and close on direct descriptors,
+// so it being supported also covers those.
+bool has_io_ring_ops(IoRing *ring)
+{
+  const uint8_t ops[] = { IORING_OP_MKDIRAT, IORING_OP_OPENAT, IORING_OP_WRITEV, IORING_OP_CLOSE };
+  size_t nops = 256;
+  struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + nops * sizeof(struct io_uring_probe_op));
+  bool supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, nops) == 0;
+  for (size_t i = 0; supported && i < sizeof(ops); i++)
+    supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return supported;
+}
+
+int create_io_ring(IoRing *ring)
+{
+  memset(ring, 0, sizeof(IoRing));
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+  if (ring->fd < 0)
+    return 1;
+
+  ring->entries = params.sq_entries;
+  ring->sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqring = mmap(NULL, ring->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cqring = mmap(NULL, ring->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqring == MAP_FAILED || ring->cqring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    destroy_io_ring(ring);
+    return 1;
+  }
+
+  char *sq = ring->sqring;
+  char *cq = ring->cqring;
+  ring->sqtail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sqmask = *(unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sqarray = (unsigned *) (sq + params.sq_off.array);
+  ring->cqhead = (unsigned *) (cq + params.cq_off.head);
+  ring->cqtail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cqmask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  if (!has_io_ring_ops(ring)) {
+    destroy_io_ring(ring);
+    return 1;
+  }
+
+  // A sparse table of direct descriptors, filled by openat.
+  int files[IO_RING_FILES];
+  for (size_t i = 0; i < IO_RING_FILES; i++)
+    files[i] = -1;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, IO_RING_FILES) != 0) {
+    destroy_io_ring(ring);
+    return 1;
+  }
+  return 0;
+}
+
+struct io_uring_sqe *get_io_sqe(IoRing *ring, uint8_t opcode, uint64_t userdata)
+{
+  unsigned tail = *ring->sqtail + ring->pending;
+  unsigned index = tail & ring->sqmask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->user_data = userdata;
+  ring->sqarray[index] = index;
+  ring->pending++;
+  return sqe;
+}
+
+// Submits the pending entries and waits for all their completions.
+// `complete(ctx, userdata, res)` is called once per completion.
+int run_io_ring(IoRing *ring, void (*complete)(void *ctx, uint64_t userdata, int res), void *ctx)
+{
+  unsigned count = ring->pending;
+  __atomic_store_n(ring->sqtail, *ring->sqtail + count, __ATOMIC_RELEASE);
+  ring->pending = 0;
+
+  unsigned submitted = 0;
+  unsigned completed = 0;
+  while (completed < count) {
+    unsigned tosubmit = count - submitted;
+    int res = syscall(__NR_io_uring_enter, ring->fd, tosubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      return 1;
+    }
+    submitted += res;
+
+    unsigned head = *ring->cqhead;
+    unsigned tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, completed++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqmask];
+      complete(ctx, cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+#define IO_STAGE_MKDIR 0
+#define IO_STAGE_OPEN  1
+#define IO_STAGE_WRITE 2
+#define IO_STAGE_CLOSE 3
+
+void complete_io_op(void *ctx, uint64_t userdata, int res)
+{
+  IoBatch *batch = ctx;
+  IoOp *op = &batch->items[userdata >> 2];
+  switch (userdata & 3) {
+    case IO_STAGE_MKDIR:
+    case IO_STAGE_OPEN: {
+      op->result = res < 0 ? res : 0;
+    } break;
+
+    case IO_STAGE_WRITE: {
+      if (op->result == 0 && res < 0)
+        op->result = res;
+      else if (op->result == 0 && (size_t) res != op->len)
+        op->result = -EIO;
+    } break;
+
+    case IO_STAGE_CLOSE: {
+      if (op->result == 0 && res < 0)
+        op->result = res;
+    } break;
+  }
+}
+
+// All directories go into one chain that keeps going when a mkdir fails,
+// so an existing directory does not stop the rest. Then every file is an
+// openat -> writev -> close chain on a registered file slot, up to
+// IO_RING_FILES files per submission. A write with more than IOV_MAX
+// buffers does not fit in one writev, so it runs synchronously after the
+// ring instead of being joined into a copy of the whole file. Returns 1
+// if no ring could be set up; operations that never completed are left
+// with -ECANCELED.
+int submit_io_batch_uring(IoBatch *batch)
+{
+  IoRing ring;
+  if (create_io_ring(&ring) != 0)
+    return 1;
+  for (size_t i = 0; i < batch->size; i++)
+    batch->items[i].result = -ECANCELED;
+
+  // The parents of the directories may be created by the same chain, so
+  // they are only resolved as far as the cached directories go.
+  struct io_uring_sqe *last = NULL;
+  for (size_t i = 0; i < batch->size; i++) {
+    IoOp *op = &batch->items[i];
+    if (op->type != IO_OP_MKDIR || resolve_io_op(batch, op, false) != 0) continue;
+    if (ring.pending + 1 > ring.entries) {
+      last->flags &= ~IOSQE_IO_HARDLINK;
+      if (run_io_ring(&ring, complete_io_op, batch) != 0) {
+        destroy_io_ring(&ring);
+        return 0;
+      }
+    }
+    struct io_uring_sqe *sqe = get_io_sqe(&ring, IORING_OP_MKDIRAT, (i << 2) | IO_STAGE_MKDIR);
+    sqe->fd = op->dirfd;
+    sqe->addr = (uintptr_t) op->name;
+    sqe->len = op->mode;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    last = sqe;
+  }
+  if (last != NULL)
+    last->flags &= ~IOSQE_IO_HARDLINK;
+  if (ring.pending > 0 && run_io_ring(&ring, complete_io_op, batch) != 0) {
+    destroy_io_ring(&ring);
+    return 0;
+  }
+
+  unsigned slot = 0;
+  for (size_t i = 0; i < batch->size; i++) {
+    IoOp *op = &batch->items[i];
+    if (op->type != IO_OP_WRITE || op->iovcnt > IOV_MAX || resolve_io_op(batch, op, true) != 0) continue;
+
+    struct io_uring_sqe *sqe = get_io_sqe(&ring, IORING_OP_OPENAT, (i << 2) | IO_STAGE_OPEN);
+    sqe->fd = op->dirfd;
+    sqe->addr = (uintptr_t) op->name;
+    sqe->len = op->mode;
+    // Direct descriptors are never inherited, O_CLOEXEC is rejected.
+    sqe->open_flags = op->flags & ~O_CLOEXEC;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = get_io_sqe(&ring, IORING_OP_WRITEV, (i << 2) | IO_STAGE_WRITE);
+    sqe->fd = slot;
+    sqe->addr = (uintptr_t) op->iov;
+    sqe->len = op->iovcnt;
+    sqe->off = 0;
+    // The close has to run even when the write fails.
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+    sqe = get_io_sqe(&ring, IORING_OP_CLOSE, (i << 2) | IO_STAGE_CLOSE);
+    sqe->file_index = slot + 1;
+
+    if (++slot == IO_RING_FILES || ring.pending + 3 > ring.entries) {
+      if (run_io_ring(&ring, complete_io_op, batch) != 0) {
+        destroy_io_ring(&ring);
+        return 0;
+      }
+      slot = 0;
+    }
+  }
+  if (ring.pending > 0)
+    run_io_ring(&ring, complete_io_op, batch);
+  destroy_io_ring(&ring);
+
+  for (size_t i = 0; i < batch->size; i++) {
+    IoOp *op = &batch->items[i];
+    if (op->type == IO_OP_WRITE && op->iovcnt > IOV_MAX) {
+      op->result = 0;
+      if (resolve_io_op(batch, op, true) == 0)
+        submit_io_op_sync(op);
+    }
+  }
+  return 0;
+}
+
+// Set once io_uring turned out to be unusable, e.g. blocked by seccomp
+// or an old kernel, so later batches go straight to the sync backend.
+bool io_uring_unavailable = false;
+
+// Runs every operation of the batch and stores its result in the op.
+// With IO_URING the batch falls back to synchronous calls when io_uring
+// is not available. A single operation gains nothing from a ring and is
+// always run synchronously.
+void submit_io_batch(IoBatch *batch, IoBackend backend)
+{
+  double start = trace_begin();
+  if (backend == IO_URING && batch->size > 1 && !__atomic_load_n(&io_uring_unavailable, __ATOMIC_RELAXED)) {
+    if (submit_io_batch_uring(batch) == 0) {
+      trace_end("submit_io_batch", "io", start, "uring");
+      return;
+    }
+    __atomic_store_n(&io_uring_unavailable, true, __ATOMIC_RELAXED);
+  }
+  for (size_t i = 0; i < batch->size; i++)
+    if (batch->items[i].type == IO_OP_MKDIR && resolve_io_op(batch, &batch->items[i], true) == 0)
+      submit_io_op_sync(&batch->items[i]);
+  for (size_t i = 0; i < batch->size; i++)
+    if (batch->items[i].type == IO_OP_WRITE && resolve_io_op(batch, &batch->items[i], true) == 0)
+      submit_io_op_sync(&batch->items[i]);
+  trace_end("submit_io_batch", "io", start, "sync");
+}
+
+// Copies a file that needs no rendering. The destination first tries to
+// share the source's extents (FICLONE), then an in-kernel copy
+// (copy_file_range), and falls back to a plain read/write loop.
+int clone_file(const char *src, int dirfd, const char *dst, mode_t mode)
+{
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+    return 1;
+  int out = openat(dirfd, dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+  if (out < 0) {
+    close(in);
+    return 1;
+  }
+
+  int res = 0;
+  if (ioctl(out, FICLONE, in) != 0) {
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+      ;
+    if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+      char buf[64 * 1024];
+      lseek(in, 0, SEEK_SET);
+      lseek(out, 0, SEEK_SET);
+      while ((n = read(in, buf, sizeof(buf))) > 0) {
+        for (ssize_t done = 0; done < n; ) {
+          ssize_t w = write(out, buf + done, n - done);
+          if (w < 0) {
+            n = -1;
+            break;
+          }
+          done += w;
+        }
+        if (n < 0)
+          break;
+      }
+    }
+    if (n < 0)
+      res = 1;
+  }
+  close(in);
+  if (close(out) != 0)
+    res = 1;
+  return res;
+}
+
+// A POSIX tar stream projects are written to instead of the disk, see
+// `--emit-archive`. Entries are named after their path relative to the
+// project root. Writers on several threads are serialized per entry.
+// With `zstd` the stream is piped through the zstd binary. `names` holds
+// the entries written so far, so that creating an entry twice fails with
+// EEXIST like it does on disk.
+typedef struct {
+  int fd;
+  pid_t zstd;
+  time_t mtime;
+  mode_t umask;
+  pthread_mutex_t lock;
+  Arena arena;
+  Config *names;
+  // The first error writing the stream, as a negated errno.
+  int error;
+} TarStream;
+
+#define TAR_BLOCK 512
+// The largest size the octal size field holds, 8GiB - 1.
+#define TAR_MAX_OCTAL_SIZE 077777777777ULL
+
+typedef struct {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} TarHeader;
+
+// Fills a ustar header. Returns 1 when `name` does not fit the name and
+// prefix fields or `size` the size field, the entry then needs a pax
+// extended header.
+int fill_tar_header(TarHeader *header, const char *name, char type, mode_t mode, uint64_t size, time_t mtime)
+{
+  memset(header, 0, sizeof(*header));
+  int res = 0;
+  size_t len = strlen(name);
+  if (len <= sizeof(header->name))
+    memcpy(header->name, name, len);
+  else {
+    // Split at a slash so the first part fits `prefix` and the rest `name`.
+    const char *split = NULL;
+    for (const char *p = name; split == NULL && (p = strchr(p, '/')) != NULL; p++)
+      if ((size_t) (p - name) <= sizeof(header->prefix) && len - (p - name) - 1 <= sizeof(header->name) && p[1] != '\0')
+        split = p;
+    if (split != NULL) {
+      memcpy(header->prefix, name, split - name);
+      memcpy(header->name, split + 1, len - (split - name) - 1);
+    }
+    else {
+      memcpy(header->name, name, sizeof(header->name));
+      res = 1;
+    }
+  }
+  if (size > TAR_MAX_OCTAL_SIZE)
+    res = 1;
+  snprintf(header->mode, sizeof(header->mode), "%07o", (unsigned) mode & 07777);
+  snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+  snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+  snprintf(header->size, sizeof(header->size), "%011llo", (unsigned long long) (size > TAR_MAX_OCTAL_SIZE ? 0 : size));
+  snprintf(header->mtime, sizeof(header->mtime), "%011llo", (unsigned long long) mtime);
+  header->typeflag = type;
+  memcpy(header->magic, "ustar", 6);
+  memcpy(header->version, "00", 2);
+  strcpy(header->uname, "root");
+  strcpy(header->gname, "root");
+
+  memset(header->chksum, ' ', sizeof(header->chksum));
+  unsigned sum = 0;
+  for (size_t i = 0; i < sizeof(*header); i++)
+    sum += ((unsigned char *) header)[i];
+  snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+  return res;
+}
+
+// Appends the pax record `<len> <key>=<value>\n` to `buf`, `<len>`
+// counting the whole record including its own digits.
+size_t append_pax_record(char *buf, const char *key, const char *value)
+{
+  size_t body = strlen(key) + strlen(value) + 3;
+  size_t len = body + 1;
+  while (snprintf(NULL, 0, "%zu", len) + body != len)
+    len++;
+  return sprintf(buf, "%zu %s=%s\n", len, key, value);
+}
+
+const char tar_zeros[TAR_BLOCK * 2] = { 0 };
+
+// Writes the header blocks of an entry with `size` bytes of content:
+// a pax extended header first when the entry does not fit ustar.
+// Called with the stream locked.
+int write_tar_header(TarStream *tar, const char *name, char type, mode_t mode, uint64_t size)
+{
+  TarHeader header;
+  if (fill_tar_header(&header, name, type, mode, size, tar->mtime) == 0)
+    return write_all(tar->fd, &header, sizeof(header));
+
+  char *records = malloc(strlen(name) + 64);
+  char sizestr[24];
+  snprintf(sizestr, sizeof(sizestr), "%llu", (unsigned long long) size);
+  size_t len = append_pax_record(records, "path", name);
+  len += append_pax_record(records + len, "size", sizestr);
+  TarHeader pax;
+  fill_tar_header(&pax, "././@PaxHeader", 'x', 0644, len, tar->mtime);
+  struct iovec iov[4] = {
+    { .iov_base = &pax, .iov_len = sizeof(pax) },
+    { .iov_base = records, .iov_len = len },
+    { .iov_base = (char *) tar_zeros, .iov_len = -len & (TAR_BLOCK - 1) },
+    { .iov_base = &header, .iov_len = sizeof(header) },
+  };
+  int res = write_all_iov(tar->fd, iov, 4);
+  free(records);
+  return res;
+}
+
+// Records `name` as written. Returns false when it already was.
+bool add_tar_name(TarStream *tar, const char *name)
+{
+  char *key = arena_strndup(&tar->arena, name, strlen(name));
+  return add_conf_entry(tar->names, key, "") == 0;
+}
+
+int add_tar_dir(TarStream *tar, const char *name, mode_t mode)
+{
+  char dirname[PATH_MAX + 1];
+  snprintf(dirname, sizeof(dirname), "%s/", name);
+  pthread_mutex_lock(&tar->lock);
+  int res = -EEXIST;
+  if (add_tar_name(tar, name))
+    res = write_tar_header(tar, dirname, '5', mode & ~tar->umask, 0) == 0 ? 0 : -errno;
+  if (res != 0 && res != -EEXIST && tar->error == 0)
+    tar->error = res;
+  pthread_mutex_unlock(&tar->lock);
+  return res;
+}
+
+// Adds a file holding the `iov` buffers. With O_EXCL in `flags` an entry
+// that was already written fails with EEXIST, otherwise it is written
+// again and the later copy wins on extraction, like O_TRUNC on disk.
+int add_tar_file(TarStream *tar, const char *name, int flags, mode_t mode, struct iovec *iov, int iovcnt, size_t len)
+{
+  struct iovec *all = malloc(sizeof(struct iovec) * (iovcnt + 1));
+  memcpy(all, iov, sizeof(struct iovec) * iovcnt);
+  all[iovcnt] = (struct iovec) { .iov_base = (char *) tar_zeros, .iov_len = -len & (TAR_BLOCK - 1) };
+
+  pthread_mutex_lock(&tar->lock);
+  int res = 0;
+  if (!add_tar_name(tar, name) && (flags & O_EXCL))
+    res = -EEXIST;
+  else if (write_tar_header(tar, name, '0', mode & ~tar->umask, len) != 0 || write_all_iov(tar->fd, all, iovcnt + 1) != 0)
+    res = -errno;
+  if (res != 0 && res != -EEXIST && tar->error == 0)
+    tar->error = res;
+  pthread_mutex_unlock(&tar->lock);
+  free(all);
+  return res;
+}
+
+// Adds the file at `src` to the archive as `name`. The content goes from
+// the file to the stream with sendfile, never through user space.
+int add_tar_copy(TarStream *tar, const char *src, const char *name, mode_t mode)
+{
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (in < 0 || fstat(in, &st) != 0) {
+    int res = -errno;
+    if (in >= 0)
+      close(in);
+    return res;
+  }
+
+  pthread_mutex_lock(&tar->lock);
+  int res = 0;
+  if (!add_tar_name(tar, name))
+    res = -EEXIST;
+  else if (write_tar_header(tar, name, '0', mode & ~tar->umask, st.st_size) != 0)
+    res = -errno;
+  for (off_t offset = 0; res == 0 && offset < st.st_size; ) {
+    ssize_t n = sendfile(tar->fd, in, &offset, st.st_size - offset);
+    if (n < 0 && errno != EINTR)
+      res = -errno;
+    // The file shrank since fstat, the archive cannot be fixed up.
+    else if (n == 0)
+      res = -EIO;
+  }
+  if (res == 0 && write_all(tar->fd, tar_zeros, -st.st_size & (TAR_BLOCK - 1)) != 0)
+    res = -errno;
+  if (res != 0 && res != -EEXIST && tar->error == 0)
+    tar->error = res;
+  pthread_mutex_unlock(&tar->lock);
+  close(in);
+  return res;
+}
+
+// Stores the result of every operation of the batch in the op, like
+// `submit_io_batch` does for the disk.
+void submit_io_batch_tar(IoBatch *batch, TarStream *tar)
+{
+  double start = trace_begin();
+  for (size_t i = 0; i < batch->size; i++) {
+    IoOp *op = &batch->items[i];
+    if (op->type == IO_OP_MKDIR)
+      op->result = add_tar_dir(tar, op->path, op->mode);
+    else
+      op->result = add_tar_file(tar, op->path, op->flags, op->mode, op->iov, op->iovcnt, op->len);
+  }
+  trace_end("submit_io_batch", "io", start, "tar");
+}
+
+// Opens a tar stream to the file at `path`, or to stdout for `-`. With
+// `zstd` the stream is compressed by a zstd child process.
+TarStream *open_tar_stream(const char *path, bool zstd)
+{
+  int fd = ISSTREQ(path, "-") ? dup(STDOUT_FILENO) : open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    ERRORF("could not open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  TarStream *tar = calloc(1, sizeof(TarStream));
+  tar->fd = fd;
+  tar->zstd = -1;
+  if (zstd) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+      ERRORF("could not start zstd: %s\n", strerror(errno));
+      close(fd);
+      free(tar);
+      return NULL;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      dup2(fds[0], STDIN_FILENO);
+      dup2(fd, STDOUT_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      close(fd);
+      execlp("zstd", "zstd", "-q", "-c", NULL);
+      ERRORF("could not run zstd: %s\n", strerror(errno));
+      _exit(127);
+    }
+    close(fds[0]);
+    close(fd);
+    if (pid < 0) {
+      ERRORF("could not start zstd: %s\n", strerror(errno));
+      close(fds[1]);
+      free(tar);
+      return NULL;
+    }
+    tar->fd = fds[1];
+    tar->zstd = pid;
+  }
+  // A reader that goes away is reported as a write error instead of
+  // killing the process.
+  struct sigaction ignore = { .sa_handler = SIG_IGN };
+  sigaction(SIGPIPE, &ignore, NULL);
+
+  char *epoch = getenv("SOURCE_DATE_EPOCH");
+  tar->mtime = epoch != NULL ? (time_t) strtoll(epoch, NULL, 10) : time(NULL);
+  tar->umask = umask(0);
+  umask(tar->umask);
+  pthread_mutex_init(&tar->lock, NULL);
+  tar->names = create_config(&tar->arena);
+  return tar;
+}
+
+// Ends the archive and closes the stream. Returns 1 when anything
+// written to the archive, or the zstd process, failed.
+int close_tar_stream(TarStream *tar)
+{
+  if (tar->error == 0 && write_all(tar->fd, tar_zeros, sizeof(tar_zeros)) != 0)
+    tar->error = -errno;
+  if (close(tar->fd) != 0 && tar->error == 0)
+    tar->error = -errno;
+  int res = tar->error != 0;
+  if (tar->zstd > 0) {
+    int status = 0;
+    pid_t pid;
+    while ((pid = waitpid(tar->zstd, &status, 0)) < 0 && errno == EINTR)
+      ;
+    if (pid < 0) {
+      ERRORF("could not wait for zstd: %s\n", strerror(errno));
+      res = 1;
+    }
+    else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      ERROR("zstd failed to compress the archive.");
+      res = 1;
+    }
+  }
+  if (tar->error != 0) {
+    ERRORF("could not write archive: %s\n", strerror(-tar->error));
+  }
+  pthread_mutex_destroy(&tar->lock);
+  arena_release(&tar->arena);
+  free(tar);
+  return res;
+}
+
+// Records a project instead of writing it, for `boiling snapshot`. Every
+// file is kept with the placeholder values cut out of its text: a buffer
+// of a write that is one of the `placeholders` values becomes a patch at
+// that point of the file. Entries are named after their path relative to
+// the project root, like in an archive.
+typedef struct {
+  uint64_t offset;
+  uint32_t placeholder;
+  uint32_t pad;
+} SnapshotPatch;
+
+#define SNAPSHOT_DIR  1
+#define SNAPSHOT_EXCL 2
+
+typedef struct {
+  char *path;
+  mode_t mode;
+  uint32_t flags;
+  char *data;
+  size_t size;
+  SnapshotPatch *patches;
+  size_t npatches;
+} SnapshotFile;
+
+typedef struct {
+  Placeholders *placeholders;
+  pthread_mutex_t lock;
+  SnapshotFile *items;
+  size_t size;
+  size_t capacity;
+  Arena arena;
+  Config *names;
+} SnapshotRecorder;
+
+SnapshotRecorder *create_snapshot_recorder(Placeholders *placeholders)
+{
+  SnapshotRecorder *rec = calloc(1, sizeof(SnapshotRecorder));
+  rec->placeholders = placeholders;
+  pthread_mutex_init(&rec->lock, NULL);
+  rec->names = create_config(&rec->arena);
+  return rec;
+}
+
+void destroy_snapshot_recorder(SnapshotRecorder *rec)
+{
+  for (size_t i = 0; i < rec->size; i++) {
+    free(rec->items[i].path);
+    free(rec->items[i].data);
+    free(rec->items[i].patches);
+  }
+  free(rec->items);
+  pthread_mutex_destroy(&rec->lock);
+  arena_release(&rec->arena);
+  free(rec);
+}
+
+// Adds an entry for `path`, or returns NULL when the project already
+// has one and `replace` is not set. Called with the recorder locked.
+SnapshotFile *add_snapshot_file(SnapshotRecorder *rec, const char *name, bool replace)
+{
+  char *key = arena_strndup(&rec->arena, name, strlen(name));
+  if (add_conf_entry(rec->names, key, "") != 0) {
+    if (!replace)
+      return NULL;
+    for (size_t i = 0; i < rec->size; i++) {
+      if (ISSTREQ(rec->items[i].path, name) && !(rec->items[i].flags & SNAPSHOT_DIR)) {
+        SnapshotFile *file = &rec->items[i];
+        free(file->data);
+        free(file->patches);
+        file->data = NULL;
+        file->patches = NULL;
+        file->size = file->npatches = 0;
+        return file;
+      }
+    }
+    return NULL;
+  }
+  if (rec->size >= rec->capacity) {
+    rec->capacity = rec->capacity == 0 ? 64 : rec->capacity * 2;
+    rec->items = realloc(rec->items, sizeof(SnapshotFile) * rec->capacity);
+  }
+  SnapshotFile *file = &rec->items[rec->size++];
+  *file = (SnapshotFile) { .path = strdup(name) };
+  return file;
+}
+
+int record_snapshot_op(SnapshotRecorder *rec, IoOp *op)
+{
+  const char *name = op->path;
+  pthread_mutex_lock(&rec->lock);
+  SnapshotFile *file = add_snapshot_file(rec, name, op->type == IO_OP_WRITE && !(op->flags & O_EXCL));
+  if (file == NULL) {
+    pthread_mutex_unlock(&rec->lock);
+    return -EEXIST;
+  }
+  file->mode = op->mode;
+  if (op->type == IO_OP_MKDIR) {
+    file->flags = SNAPSHOT_DIR;
+    pthread_mutex_unlock(&rec->lock);
+    return 0;
+  }
+
+  file->flags = op->flags & O_EXCL ? SNAPSHOT_EXCL : 0;
+  file->data = malloc(op->len > 0 ? op->len : 1);
+  for (int i = 0; i < op->iovcnt; i++) {
+    int placeholder = -1;
+    for (int p = 0; p < TOTAL_PLACEHOLDERS; p++)
+      if (op->iov[i].iov_base == rec->placeholders->values[p])
+        placeholder = p;
+    if (placeholder != -1) {
+      file->patches = realloc(file->patches, sizeof(SnapshotPatch) * (file->npatches + 1));
+      file->patches[file->npatches++] = (SnapshotPatch) { .offset = file->size, .placeholder = placeholder };
+      continue;
+    }
+    memcpy(file->data + file->size, op->iov[i].iov_base, op->iov[i].iov_len);
+    file->size += op->iov[i].iov_len;
+  }
+  pthread_mutex_unlock(&rec->lock);
+  return 0;
+}
+
+// Records a static file, whose content is copied into the snapshot.
+int record_snapshot_copy(SnapshotRecorder *rec, const char *src, const char *path, mode_t mode)
+{
+  int fd = open(src, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    int res = -errno;
+    if (fd >= 0)
+      close(fd);
+    return res;
+  }
+  struct iovec *iov = malloc(sizeof(struct iovec));
+  iov->iov_base = malloc(st.st_size > 0 ? st.st_size : 1);
+  iov->iov_len = 0;
+  ssize_t n;
+  while (iov->iov_len < (size_t) st.st_size &&
+         (n = pread(fd, (char *) iov->iov_base + iov->iov_len, st.st_size - iov->iov_len, iov->iov_len)) > 0)
+    iov->iov_len += n;
+  close(fd);
+
+  IoBatch batch = { 0 };
+  io_batch_write(&batch, path, O_EXCL, mode, iov, 1);
+  void *data = iov->iov_base;
+  int res = batch.items[0].len == (size_t) st.st_size ? record_snapshot_op(rec, &batch.items[0]) : -EIO;
+  destroy_io_batch(&batch);
+  free(data);
+  return res;
+}
+
+void submit_io_batch_snapshot(IoBatch *batch, SnapshotRecorder *rec)
+{
+  for (size_t i = 0; i < batch->size; i++)
+    batch->items[i].result = record_snapshot_op(rec, &batch->items[i]);
+}
+
+// Where projects are written: to the disk with the `io` backend, as
+// entries of the `tar` stream, or into the `snapshot` being recorded.
+// Every project action goes through the sink, so all of them are driven
+// by the same action list. Disk writes resolve paths from the directory
+// fds of `fs` when it is set.
+typedef struct {
+  IoBackend io;
+  TarStream *tar;
+  SnapshotRecorder *snapshot;
+  ProjectFs *fs;
+} OutputSink;
+
+bool writes_to_disk(OutputSink *sink)
+{
+  return sink->tar == NULL && sink->snapshot == NULL;
+}
+
+void submit_to_sink(OutputSink *sink, IoBatch *batch)
+{
+  if (sink->tar != NULL)
+    submit_io_batch_tar(batch, sink->tar);
+  else if (sink->snapshot != NULL)
+    submit_io_batch_snapshot(batch, sink->snapshot);
+  else {
+    batch->fs = sink->fs;
+    submit_io_batch(batch, sink->io);
+  }
+}
+
+// A snapshot image is a single file, mapped when it is used, laid out as
+//
+//   SnapshotHeader
+//   SnapshotEntry[nentries]
+//   SnapshotPatch[npatches]
+//   strings: entry paths and the placeholder values it was taken with
+//   data: the text of every file with the placeholder values cut out
+//
+// Directories come before their contents. The patches of an entry are
+// consecutive and ordered by offset.
+#define SNAPSHOT_MAGIC   "BOILSNP"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t nplaceholders;
+  uint64_t nentries;
+  uint64_t npatches;
+  uint64_t entries_offset;
+  uint64_t patches_offset;
+  uint64_t strings_offset;
+  uint64_t data_offset;
+  uint64_t size;
+  uint64_t values[TOTAL_PLACEHOLDERS];
+} SnapshotHeader;
+
+typedef struct {
+  uint64_t path;
+  uint32_t mode;
+  uint32_t flags;
+  uint64_t data;
+  uint64_t size;
+  uint64_t patches;
+  uint64_t npatches;
+} SnapshotEntry;
+
+int write_snapshot(SnapshotRecorder *rec, char *path)
+{
+  SnapshotHeader header = { 0 };
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.nplaceholders = TOTAL_PLACEHOLDERS;
+  header.nentries = rec->size;
+  uint64_t strings_size = 0;
+  uint64_t data_size = 0;
+  for (size_t i = 0; i < rec->size; i++) {
+    header.npatches += rec->items[i].npatches;
+    strings_size += strlen(rec->items[i].path) + 1;
+    data_size += rec->items[i].size;
+  }
+  for (size_t p = 0; p < TOTAL_PLACEHOLDERS; p++)
+    strings_size += strlen(rec->placeholders->values[p]) + 1;
+  header.entries_offset = sizeof(header);
+  header.patches_offset = header.entries_offset + sizeof(SnapshotEntry) * header.nentries;
+  header.strings_offset = header.patches_offset + sizeof(SnapshotPatch) * header.npatches;
+  header.data_offset = ALIGN8(header.strings_offset + strings_size);
+  header.size = header.data_offset + data_size;
+
+  char *image = calloc(1, header.size);
+  SnapshotEntry *entries = (SnapshotEntry *) (image + header.entries_offset);
+  SnapshotPatch *patches = (SnapshotPatch *) (image + header.patches_offset);
+  uint64_t string = 0;
+  uint64_t data = 0;
+  uint64_t patch = 0;
+  // Directories first, in the order they were created.
+  for (int dirs = 1; dirs >= 0; dirs--) {
+    for (size_t i = 0; i < rec->size; i++) {
+      SnapshotFile *file = &rec->items[i];
+      if (!(file->flags & SNAPSHOT_DIR) != !dirs)
+        continue;
+      *entries++ = (SnapshotEntry) {
+        .path = string,
+        .mode = file->mode,
+        .flags = file->flags,
+        .data = data,
+        .size = file->size,
+        .patches = patch,
+        .npatches = file->npatches,
+      };
+      strcpy(image + header.strings_offset + string, file->path);
+      string += strlen(file->path) + 1;
+      if (file->size > 0)
+        memcpy(image + header.data_offset + data, file->data, file->size);
+      data += file->size;
+      memcpy(patches + patch, file->patches, sizeof(SnapshotPatch) * file->npatches);
+      patch += file->npatches;
+    }
+  }
+  for (size_t p = 0; p < TOTAL_PLACEHOLDERS; p++) {
+    header.values[p] = string;
+    strcpy(image + header.strings_offset + string, rec->placeholders->values[p]);
+    string += strlen(rec->placeholders->values[p]) + 1;
+  }
+  memcpy(image, &header, sizeof(header));
+  int res = write_file_atomic(path, image, header.size);
+  free(image);
+  return res;
+}
+
+// A mapped snapshot image, see `write_snapshot`.
+typedef struct {
+  char *image;
+  size_t size;
+  SnapshotHeader *header;
+  SnapshotEntry *entries;
+  SnapshotPatch *patches;
+  char *strings;
+  char *data;
+} Snapshot;
+
+bool is_snapshot_string(Snapshot *snap, uint64_t offset)
+{
+  uint64_t size = snap->header->data_offset - snap->header->strings_offset;
+  return offset < size && memchr(snap->strings + offset, '\0', size - offset) != NULL;
+}
+
+// Checks every offset of the image, so it can be used without further
+// bounds checks.
+bool is_valid_snapshot(Snapshot *snap)
+{
+  SnapshotHeader *header = snap->header;
+  if (snap->size < sizeof(SnapshotHeader) ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != SNAPSHOT_VERSION || header->nplaceholders != TOTAL_PLACEHOLDERS ||
+      header->size != snap->size ||
+      header->entries_offset != sizeof(SnapshotHeader) ||
+      header->nentries > snap->size / sizeof(SnapshotEntry) ||
+      header->npatches > snap->size / sizeof(SnapshotPatch) ||
+      header->patches_offset != header->entries_offset + sizeof(SnapshotEntry) * header->nentries ||
+      header->strings_offset != header->patches_offset + sizeof(SnapshotPatch) * header->npatches ||
+      header->data_offset < header->strings_offset || header->data_offset > snap->size)
+    return false;
+  for (size_t p = 0; p < TOTAL_PLACEHOLDERS; p++)
+    if (!is_snapshot_string(snap, header->values[p]))
+      return false;
+  uint64_t datasize = snap->size - header->data_offset;
+  for (size_t i = 0; i < header->nentries; i++) {
+    SnapshotEntry *entry = &snap->entries[i];
+    if (!is_snapshot_string(snap, entry->path) || entry->data > datasize || entry->size > datasize - entry->data ||
+        entry->patches > header->npatches || entry->npatches > header->npatches - entry->patches)
+      return false;
+    uint64_t last = 0;
+    for (size_t p = entry->patches; p < entry->patches + entry->npatches; p++) {
+      SnapshotPatch *patch = &snap->patches[p];
+      if (patch->offset < last || patch->offset > entry->size || patch->placeholder >= TOTAL_PLACEHOLDERS)
+        return false;
+      last = patch->offset;
+    }
+  }
+  return true;
+}
+
+Snapshot *open_snapshot(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    ERRORF("could not open snapshot %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  struct stat st;
+  Snapshot *snap = calloc(1, sizeof(Snapshot));
+  snap->size = fstat(fd, &st) == 0 ? st.st_size : 0;
+  snap->image = snap->size >= sizeof(SnapshotHeader) ? mmap(NULL, snap->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (snap->image != MAP_FAILED) {
+    snap->header = (SnapshotHeader *) snap->image;
+    snap->entries = (SnapshotEntry *) (snap->image + sizeof(SnapshotHeader));
+    snap->patches = (SnapshotPatch *) (snap->image + snap->header->patches_offset);
+    snap->strings = snap->image + snap->header->strings_offset;
+    snap->data = snap->image + snap->header->data_offset;
+  }
+  if (snap->image == MAP_FAILED || !is_valid_snapshot(snap)) {
+    ERRORF("%s is not a valid snapshot.\n", path);
+    if (snap->image != MAP_FAILED)
+      munmap(snap->image, snap->size);
+    free(snap);
+    return NULL;
+  }
+  return snap;
+}
+
+void close_snapshot(Snapshot *snap)
+{
+  munmap(snap->image, snap->size);
+  free(snap);
+}
+
+// Returns the buffers of an entry: literal slices of the mapped image
+// with the placeholder values in between.
+struct iovec *snapshot_iovecs(Snapshot *snap, SnapshotEntry *entry, Placeholders *placeholders, int *iovcnt)
+{
+  struct iovec *iov = malloc(sizeof(struct iovec) * (entry->npatches * 2 + 1));
+  int n = 0;
+  uint64_t literal = 0;
+  for (size_t p = entry->patches; p < entry->patches + entry->npatches; p++) {
+    SnapshotPatch *patch = &snap->patches[p];
+    if (patch->offset > literal)
+      iov[n++] = (struct iovec) { .iov_base = snap->data + entry->data + literal, .iov_len = patch->offset - literal };
+    char *value = placeholders->values[patch->placeholder];
+    iov[n++] = (struct iovec) { .iov_base = value, .iov_len = strlen(value) };
+    literal = patch->offset;
+  }
+  if (entry->size > literal)
+    iov[n++] = (struct iovec) { .iov_base = snap->data + entry->data + literal, .iov_len = entry->size - literal };
+  *iovcnt = n;
+  return iov;
+}
+
+// Creates the project recorded in `snap` inside `root`. `placeholders`
+// holds the values of this project, NULL values keep the ones the
+// snapshot was taken with. Like a template tree, existing directories
+// are reused, existing files are left alone with a warning and on
+// failure whatever was created on disk is removed again.
+int materialize_snapshot(Snapshot *snap, Placeholders *placeholders, char *root, OutputSink *sink)
+{
+  double start = trace_begin();
+  for (size_t p = 0; p < TOTAL_PLACEHOLDERS; p++)
+    if (placeholders->values[p] == NULL)
+      placeholders->values[p] = snap->strings + snap->header->values[p];
+
+  IoBatch batch = { 0 };
+  for (size_t i = 0; i < snap->header->nentries; i++) {
+    SnapshotEntry *entry = &snap->entries[i];
+    const char *dst = snap->strings + entry->path;
+    if (entry->flags & SNAPSHOT_DIR)
+      io_batch_mkdir(&batch, dst, entry->mode);
+    else {
+      int iovcnt;
+      struct iovec *iov = snapshot_iovecs(snap, entry, placeholders, &iovcnt);
+      io_batch_write(&batch, dst, entry->flags & SNAPSHOT_EXCL ? O_EXCL : O_TRUNC, entry->mode, iov, iovcnt);
+    }
+  }
+  submit_to_sink(sink, &batch);
+
+  int res = 0;
+  for (size_t i = 0; i < batch.size; i++) {
+    IoOp *op = &batch.items[i];
+    const char *name = snap->strings + snap->entries[i].path;
+    if (op->result == -EEXIST) {
+      if (op->type == IO_OP_WRITE)
+        fprintf(stderr, "warning: %s already exists.\n", name);
+    }
+    else if (op->result != 0 && res == 0) {
+      ERRORF("could not create %s: %s\n", name, strerror(-op->result));
+      res = 1;
+    }
+  }
+  if (res != 0 && writes_to_disk(sink)) {
+    for (size_t i = batch.size; i-- > 0; )
+      if (batch.items[i].result == 0)
+        remove_project_path(sink->fs, batch.items[i].path);
+  }
+  destroy_io_batch(&batch);
+  trace_end("materialize_snapshot", "project", start, root);
+  return res;
+}
+
+
+// The object store keeps one read-only copy of every static template
+// file under ~/.cache/boiling/objects/<xx>/<rest>.<mode>, where <xx> and
+// <rest> are the hex SHA-256 of its content and <mode> its permissions
+// without the write bits. Projects get reflinks or hard links to the
+// objects instead of copies of the template files. `editable` is the
+// language's list of files that must always be copied.
+typedef struct {
+  char *dir;
+  const char *editable;
+} ObjectStore;
+
+char *find_object_store()
+{
+  char *dir = find_cache_dir();
+  if (dir == NULL)
+    return NULL;
+  char *path = malloc(MAX_CONFIG_PATH);
+  snprintf(path, MAX_CONFIG_PATH, "%s/objects", dir);
+  free(dir);
+  return path;
+}
+
+typedef struct {
+  const char *path;
+  bool matched;
+} EditableMatch;
+
+// A pattern with a slash matches the path inside the template
+// directory, any other pattern matches the file name.
+int match_editable(void *ctx, const char *item, size_t len)
+{
+  EditableMatch *match = ctx;
+  char pattern[PATH_MAX];
+  if (len >= sizeof(pattern))
+    return 0;
+  memcpy(pattern, item, len);
+  pattern[len] = '\0';
+  const char *name = strrchr(match->path, '/');
+  const char *subject = memchr(item, '/', len) != NULL || name == NULL ? match->path : name + 1;
+  match->matched = fnmatch(pattern, subject, 0) == 0;
+  return match->matched;
+}
+
+bool is_editable_file(ObjectStore *store, const char *path)
+{
+  EditableMatch match = { .path = path, .matched = false };
+  if (store->editable != NULL)
+    for_each_list_item(store->editable, match_editable, &match);
+  return match.matched;
+}
+
+// Returns the object holding the content of the static template `tpl`
+// loaded from `srcpath`, adding it to the store when it is missing.
+// Returns NULL when the file cannot be stored; it is then copied as usual.
+char *store_object(ObjectStore *store, Template *tpl, const char *srcpath, mode_t mode)
+{
+  if (hash_template(tpl, srcpath) != 0)
+    return NULL;
+  char hex[65];
+  for (int i = 0; i < 32; i++)
+    sprintf(hex + i * 2, "%02x", tpl->digest[i]);
+  mode &= 0555;
+  char *object = malloc(PATH_MAX);
+  snprintf(object, PATH_MAX, "%s/%.2s/%s.%03o", store->dir, hex, hex + 2, (unsigned) mode);
+  if (access(object, F_OK) == 0)
+    return object;
+
+  // Batch workers may store the same object at once, each needs its own
+  // temporary file.
+  char tmppath[PATH_MAX + 64];
+  snprintf(tmppath, sizeof(tmppath), "%s.%ld.%lu.tmp", object, (long) getpid(), (unsigned long) pthread_self());
+  make_parent_dirs(object);
+  if (clone_file(srcpath, AT_FDCWD, tmppath, mode) != 0 || rename(tmppath, object) != 0) {
+    unlink(tmppath);
+    free(object);
+    return NULL;
+  }
+  return object;
+}
+
+// Creates `dst`, relative to `dirfd`, from a store object, as a reflink
+// with `mode` when the filesystem supports it and otherwise as a hard
+// link, which shares the object's read-only mode. Returns 1 with errno
+// set when neither is possible.
+int link_store_object(const char *object, int dirfd, const char *dst, mode_t mode)
+{
+  int in = open(object, O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+    return 1;
+  int out = openat(dirfd, dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+  if (out < 0) {
+    close(in);
+    return 1;
+  }
+  int cloned = ioctl(out, FICLONE, in);
+  close(in);
+  if (close(out) == 0 && cloned == 0)
+    return 0;
+  unlinkat(dirfd, dst, 0);
+  return linkat(AT_FDCWD, object, dirfd, dst, 0) == 0 ? 0 : 1;
+}
+
+// An entry of a language template directory. Directories and static
+// files have no compiled template: static files are cloned as they are,
+// or linked from `object` when they are in the object store. `size` and
+// `mtime` are what the entry was loaded from, see `is_template_tree_fresh`.
+typedef struct {
+  char *path;
+  char *srcpath;
+  bool isdir;
+  mode_t mode;
+  off_t size;
+  struct timespec mtime;
+  Template *tpl;
+  char *object;
+} TemplateFile;
+
+// `root` is the template directory and `mtime` its mtime when it was
+// loaded, `exists` is false when it was missing.
+typedef struct {
+  TemplateFile *items;
+  size_t size;
+  size_t capacity;
+  char *root;
+  bool exists;
+  struct timespec mtime;
+} TemplateTree;
+
+void destroy_template_tree(TemplateTree *tree)
+{
+  for (size_t i = 0; i < tree->size; i++) {
+    free(tree->items[i].path);
+    free(tree->items[i].srcpath);
+    free(tree->items[i].object);
+    if (tree->items[i].tpl != NULL)
+      destroy_template(tree->items[i].tpl);
+  }
+  free(tree->items);
+  free(tree->root);
+  free(tree);
+}
+
+// Walks `root/rel` depth first. Every directory is listed before its
+// contents so entries can be created in order. With a `store` static
+// files are added to it.
+int collect_template_tree(TemplateTree *tree, const char *root, const char *rel, ObjectStore *store)
+{
+  char dirpath[PATH_MAX];
+  snprintf(dirpath, sizeof(dirpath), "%s%s%s", root, rel[0] != '\0' ? "/" : "", rel);
+  DIR *dir = opendir(dirpath);
+  if (dir == NULL) {
+    ERRORF("could not open template directory %s: %s\n", dirpath, strerror(errno));
+    return 1;
+  }
+
+  int res = 0;
+  struct dirent *ent;
+  while (res == 0 && (ent = readdir(dir)) != NULL) {
+    if (ISSTREQ(ent->d_name, ".") || ISSTREQ(ent->d_name, ".."))
+      continue;
+    char relpath[PATH_MAX];
+    char srcpath[PATH_MAX];
+    if (snprintf(relpath, sizeof(relpath), "%s%s%s", rel, rel[0] != '\0' ? "/" : "", ent->d_name) >= (int) sizeof(relpath) ||
+        snprintf(srcpath, sizeof(srcpath), "%s/%s", root, relpath) >= (int) sizeof(srcpath)) {
+      ERRORF("template path %s/%s is too long.\n", dirpath, ent->d_name);
+      res = 1;
+      break;
+    }
+    struct stat st;
+    if (stat(srcpath, &st) != 0) {
+      ERRORF("could not stat %s: %s\n", srcpath, strerror(errno));
+      res = 1;
+      break;
+    }
+    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+      continue;
+
+    TemplateFile file = {
+      .path = strdup(relpath),
+      .srcpath = strdup(srcpath),
+      .isdir = S_ISDIR(st.st_mode),
+      .mode = st.st_mode & 0777,
+      .size = st.st_size,
+      .mtime = st.st_mtim,
+      .tpl = NULL,
+      .object = NULL,
+    };
+    if (!file.isdir) {
+      file.tpl = load_template(srcpath, true);
+      if (file.tpl == NULL) {
+        ERRORF("could not load template %s\n", srcpath);
+        free(file.path);
+        free(file.srcpath);
+        res = 1;
+        break;
+      }
+      if (is_static_template(file.tpl)) {
+        if (store != NULL && !is_editable_file(store, relpath))
+          file.object = store_object(store, file.tpl, srcpath, file.mode);
+        destroy_template(file.tpl);
+        file.tpl = NULL;
+      }
+    }
+    if (tree->size >= tree->capacity) {
+      tree->capacity = tree->capacity == 0 ? 16 : tree->capacity * 2;
+      tree->items = realloc(tree->items, sizeof(TemplateFile) * tree->capacity);
+    }
+    tree->items[tree->size++] = file;
+    if (file.isdir)
+      res = collect_template_tree(tree, root, relpath, store);
+  }
+  closedir(dir);
+  return res;
+}
+
+// Loads the template directory `dir`. A missing directory is an empty
+// tree, NULL is only returned on errors. `store` may be NULL.
+TemplateTree *load_template_tree(const char *dir, ObjectStore *store)
+{
+  TemplateTree *tree = calloc(1, sizeof(TemplateTree));
+  tree->root = strdup(dir);
+  struct stat st;
+  if (stat(dir, &st) != 0)
+    return tree;
+  tree->exists = true;
+  tree->mtime = st.st_mtim;
+  if (collect_template_tree(tree, dir, "", store) != 0) {
+    destroy_template_tree(tree);
+    return NULL;
+  }
+  return tree;
+}
+
+bool is_same_mtime(struct timespec a, struct timespec b)
+{
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Whether the template directory and every entry in it are as they were
+// loaded. A file added to or removed from any directory changes that
+// directory's mtime, and editing a file changes its size or mtime.
+bool is_template_tree_fresh(TemplateTree *tree)
+{
+  struct stat st;
+  bool exists = stat(tree->root, &st) == 0;
+  if (exists != tree->exists || (exists && !is_same_mtime(st.st_mtim, tree->mtime)))
+    return false;
+  for (size_t i = 0; i < tree->size; i++) {
+    TemplateFile *file = &tree->items[i];
+    if (stat(file->srcpath, &st) != 0 || S_ISDIR(st.st_mode) != file->isdir ||
+        st.st_size != file->size || !is_same_mtime(st.st_mtim, file->mtime))
+      return false;
+  }
+  return true;
+}
+
+void resolve_year_placeholder(Placeholders *placeholders)
+{
+  time_t now = time(NULL);
+  struct tm curtime;
+  localtime_r(&now, &curtime);
+  snprintf(placeholders->year, sizeof(placeholders->year), "%d", curtime.tm_year + 1900);
+  placeholders->values[PLACEHOLDER_YEAR] = placeholders->year;
+}
+
+void resolve_placeholders(Placeholders *placeholders, Configs *confs)
+{
+  ConfigEntry *entry = get_conf_entry(confs->items[GLOBAL_CONFIG], "name");
+  placeholders->values[PLACEHOLDER_NAME] = entry != NULL ? entry->value : "";
+  resolve_year_placeholder(placeholders);
+}
+
+// Returns the buffers of the rendered template: literal segments point
+// into the template text and placeholders into the resolved values.
+struct iovec *template_iovecs(Template *tpl, Placeholders *placeholders, int *iovcnt)
+{
+  struct iovec *iov = malloc(sizeof(struct iovec) * (tpl->size > 0 ? tpl->size : 1));
+  for (size_t i = 0; i < tpl->size; i++) {
+    TemplateSegment seg = tpl->items[i];
+    if (seg.placeholder == LITERAL_SEGMENT)
+      iov[i] = (struct iovec) { .iov_base = tpl->data + seg.offset, .iov_len = seg.len };
+    else {
+      char *value = placeholders->values[seg.placeholder];
+      iov[i] = (struct iovec) { .iov_base = value, .iov_len = strlen(value) };
+    }
+  }
+  *iovcnt = tpl->size;
+  return iov;
+}
+
+void io_batch_template(IoBatch *batch, Template *tpl, Placeholders *placeholders, const char *dst, int flags, mode_t mode)
+{
+  int iovcnt;
+  struct iovec *iov = template_iovecs(tpl, placeholders, &iovcnt);
+  io_batch_write(batch, dst, flags, mode, iov, iovcnt);
+}
+
+// Removes the entries of `tree` marked in `created` from the project
+// open in `fs`.
+void remove_template_tree(TemplateTree *tree, bool *created, ProjectFs *fs)
+{
+  // Directories come before their contents, so removing in reverse
+  // order empties every directory before it is removed.
+  for (size_t i = tree->size; i-- > 0; ) {
+    if (!created[i]) continue;
+    remove_project_path(fs, tree->items[i].path);
+    created[i] = false;
+  }
+}
+
+// Creates the entries of `tree` in the project of `sink` and marks the
+// ones it created in `created`. Existing directories are reused and existing
+// files are left alone with a warning. On failure everything created so
+// far on disk is removed again; an archive cannot be taken back.
+int copy_template_tree(TemplateTree *tree, Placeholders *placeholders, bool *created, OutputSink *sink)
+{
+  // Directories and rendered files go through one batch, static files
+  // are cloned once their directories exist.
+  IoBatch batch = { 0 };
+  size_t *files = malloc(sizeof(size_t) * (tree->size > 0 ? tree->size : 1));
+  for (size_t i = 0; i < tree->size; i++) {
+    TemplateFile *file = &tree->items[i];
+    if (file->isdir || file->tpl != NULL) {
+      if (file->isdir)
+        io_batch_mkdir(&batch, file->path, file->mode | 0700);
+      else
+        io_batch_template(&batch, file->tpl, placeholders, file->path, O_EXCL, file->mode);
+      files[batch.size - 1] = i;
+    }
+  }
+  submit_to_sink(sink, &batch);
+
+  int res = 0;
+  size_t op = 0;
+  for (size_t i = 0; res == 0 && i < tree->size; i++) {
+    TemplateFile *file = &tree->items[i];
+    int status;
+    if (op < batch.size && files[op] == i)
+      status = batch.items[op++].result;
+    else {
+      // An object removed by `boiling gc` since the tree was loaded is
+      // cloned from the template instead.
+      if (sink->tar != NULL)
+        status = add_tar_copy(sink->tar, file->srcpath, file->path, file->mode);
+      else if (sink->snapshot != NULL)
+        status = record_snapshot_copy(sink->snapshot, file->srcpath, file->path, file->mode);
+      else {
+        int dirfd;
+        const char *name;
+        status = resolve_project_path(sink->fs, file->path, &dirfd, &name, true);
+        if (status == 0 && (file->object == NULL || link_store_object(file->object, dirfd, name, file->mode) != 0))
+          status = clone_file(file->srcpath, dirfd, name, file->mode) == 0 ? 0 : -errno;
+      }
+    }
+
+    if (status == 0)
+      created[i] = true;
+    else if (status == -EEXIST) {
+      if (!file->isdir)
+        fprintf(stderr, "warning: %s already exists.\n", file->path);
+    }
+    else {
+      ERRORF("could not create %s: %s\n", file->path, strerror(-status));
+      res = 1;
+    }
+  }
+  // Entries after a failure may still have been created by the batch.
+  for (; op < batch.size; op++)
+    if (batch.items[op].result == 0)
+      created[files[op]] = true;
+
+  if (res != 0 && writes_to_disk(sink))
+    remove_template_tree(tree, created, sink->fs);
+  destroy_io_batch(&batch);
+  free(files);
+  return res;
+}
+
+// State shared by every project created in one run: the parsed config,
+// the config directory, the compiled license, the placeholder values and
+// the template tree of every language in use. `jobs` is the number of
+// threads the actions of a single project run on and `sink` where they
+// write the project.
+typedef struct {
+  Configs *confs;
+  char *confdir;
+  Template *license;
+  Placeholders placeholders;
+  TemplateTree **trees;
+  size_t jobs;
+  OutputSink sink;
+} ScaffoldContext;
+
+// Returns NULL when the license template exists but cannot be compiled.
+ScaffoldContext *create_scaffold_context(Configs *confs)
+{
+  ScaffoldContext *ctx = calloc(1, sizeof(ScaffoldContext));
+  ctx->confs = confs;
+  ctx->trees = calloc(confs->size, sizeof(TemplateTree *));
+  ctx->confdir = find_config_dir();
+  ctx->jobs = 1;
+  ctx->sink = (OutputSink) { .io = IO_SYNC, .tar = NULL, .snapshot = NULL, .fs = NULL };
+  resolve_placeholders(&ctx->placeholders, confs);
+  if (ctx->confdir != NULL) {
+    char *path = concat_path_file(ctx->confdir, "LICENSE");
+    double start = trace_begin();
+    if (file_exists(path))
+      ctx->license = load_template(path, true);
+    // The license is always rendered, never cloned, so unlike static
+    // template files it needs its text even without placeholders.
+    if (ctx->license != NULL && ctx->license->data == NULL && read_template_file(ctx->license, path) != 0) {
+      destroy_template(ctx->license);
+      ctx->license = NULL;
+    }
+    trace_end("load_license", "template", start, path);
+    bool failed = ctx->license == NULL && file_exists(path);
+    free(path);
+    if (failed) {
+      free(ctx->trees);
+      free(ctx->confdir);
+      free(ctx);
+      return NULL;
+    }
   }
+  return ctx;
+}
 
-  entry = get_conf_entry(config, "gitrepo");
-  if (entry != NULL && !is_bool(entry->value)) {
-    ERRORF("`gitrepo` expects boolean value. `%s` provided.\n", entry->value);
-    return false;
+// Loads the template tree of the language at `lindex` from
+// `templates/<lang>` next to the config, `<lang>` being the name the
+// language was defined with rather than an alias. Must be called for every
+// language before projects are created, the trees are shared read-only.
+int load_scaffold_language(ScaffoldContext *ctx, int lindex)
+{
+  if (ctx->trees[lindex] != NULL)
+    return 0;
+  if (ctx->confdir == NULL) {
+    ctx->trees[lindex] = calloc(1, sizeof(TemplateTree));
+    return 0;
+  }
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/templates/%s", ctx->confdir, language_name(ctx->confs, lindex));
+  ObjectStore store = { 0 };
+  ConfigEntry *entry = get_conf_entry(ctx->confs->items[GLOBAL_CONFIG], "store");
+  if (entry != NULL && ISSTREQ(entry->value, "true")) {
+    store.dir = find_object_store();
+    entry = get_conf_entry(ctx->confs->items[lindex], "editable");
+    store.editable = entry != NULL ? entry->value : NULL;
   }
+  double start = trace_begin();
+  ctx->trees[lindex] = load_template_tree(dir, store.dir != NULL ? &store : NULL);
+  trace_end("load_template_tree", "template", start, dir);
+  free(store.dir);
+  return ctx->trees[lindex] == NULL;
+}
+
+// Whether the LICENSE and the loaded template trees are unchanged on
+// disk, so a long-lived context never renders stale or truncated files.
+bool is_scaffold_fresh(ScaffoldContext *ctx)
+{
+  if (ctx->confdir != NULL) {
+    char *path = concat_path_file(ctx->confdir, "LICENSE");
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    free(path);
+    if (exists != (ctx->license != NULL))
+      return false;
+    if (exists && ((size_t) st.st_size != ctx->license->datasize || !is_same_mtime(st.st_mtim, ctx->license->mtime)))
+      return false;
+  }
+  for (size_t i = 0; i < ctx->confs->size; i++)
+    if (ctx->trees[i] != NULL && ctx->trees[i]->root != NULL && !is_template_tree_fresh(ctx->trees[i]))
+      return false;
   return true;
 }
 
-bool is_valid_clang_config(Config *config)
+void destroy_scaffold_context(ScaffoldContext *ctx)
 {
-  if (config->size == 0)
-    return true;
-  ConfigEntry *entry = get_conf_entry(config, "bin");
-  if (entry != NULL && !is_valid_path(entry->value)) {
-    ERRORF("`%s` is not a valid path.\n", entry->value);
-    return false;
+  if (ctx->license != NULL)
+    destroy_template(ctx->license);
+  for (size_t i = 0; i < ctx->confs->size; i++)
+    if (ctx->trees[i] != NULL)
+      destroy_template_tree(ctx->trees[i]);
+  free(ctx->trees);
+  free(ctx->confdir);
+  free(ctx);
+}
+
+// The scaffold context `boiling serve` keeps warm, with every language
+// loaded. See `resident_configs`.
+ScaffoldContext *resident_scaffold = NULL;
+
+ScaffoldContext *open_scaffold()
+{
+  if (resident_scaffold != NULL)
+    return resident_scaffold;
+  Configs *confs = get_configs();
+  if (confs == NULL)
+    return NULL;
+  ScaffoldContext *ctx = create_scaffold_context(confs);
+  if (ctx == NULL)
+    put_configs(confs);
+  return ctx;
+}
+
+void close_scaffold(ScaffoldContext *ctx)
+{
+  if (ctx == resident_scaffold)
+    return;
+  Configs *confs = ctx->confs;
+  destroy_scaffold_context(ctx);
+  put_configs(confs);
+}
+
+int remove_tree_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+  (void) st;
+  (void) flag;
+  (void) ftw;
+  return remove(path) != 0;
+}
+
+// Removes `path` and everything below it.
+int remove_tree(char *path)
+{
+  return nftw(path, remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Like remove_tree for `name` relative to `dirfd`. Symlinks are removed,
+// never followed.
+int remove_tree_at(int dirfd, const char *name)
+{
+  if (unlinkat(dirfd, name, 0) == 0)
+    return 0;
+  if (errno != EISDIR)
+    return 1;
+  int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return 1;
+  DIR *dir = fdopendir(fd);
+  if (dir == NULL) {
+    close(fd);
+    return 1;
   }
-  entry = get_conf_entry(config, "src");
-  if (entry != NULL && !is_valid_path(entry->value)) {
-    ERRORF("`%s` is not a valid path.\n", entry->value);
-    return false;
+  int res = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL)
+    if (!ISSTREQ(ent->d_name, ".") && !ISSTREQ(ent->d_name, ".."))
+      res |= remove_tree_at(fd, ent->d_name);
+  closedir(dir);
+  return unlinkat(dirfd, name, AT_REMOVEDIR) == 0 ? res : 1;
+}
+
+#define DEFAULT_GIT_BRANCH "master"
+
+// Writes the layout of an empty non-bare repository, the same one
+// `git init` creates minus the sample hooks and the description.
+int init_git_repository(char *branch, OutputSink *sink)
+{
+  const char *dirs[] = {
+    ".git", ".git/objects", ".git/objects/info", ".git/objects/pack",
+    ".git/refs", ".git/refs/heads", ".git/refs/tags", ".git/info",
+  };
+  char head[MAX_VALUE_LEN + 32];
+  snprintf(head, sizeof(head), "ref: refs/heads/%s\n", branch != NULL ? branch : DEFAULT_GIT_BRANCH);
+  const char *config =
+    "[core]\n"
+    "\trepositoryformatversion = 0\n"
+    "\tfilemode = true\n"
+    "\tbare = false\n"
+    "\tlogallrefupdates = true\n";
+  const char *files[][2] = {
+    { ".git/HEAD", head },
+    { ".git/config", config },
+    { ".git/info/exclude", "" },
+  };
+
+  IoBatch batch = { 0 };
+  for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++)
+    io_batch_mkdir(&batch, dirs[i], 0777);
+  for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+    struct iovec *iov = malloc(sizeof(struct iovec));
+    iov->iov_base = (char *) files[i][1];
+    iov->iov_len = strlen(files[i][1]);
+    io_batch_write(&batch, files[i][0], O_TRUNC, 0666, iov, 1);
   }
-  return true;
+  submit_to_sink(sink, &batch);
+
+  int res = 0;
+  for (size_t i = 0; res == 0 && i < batch.size; i++) {
+    if (batch.items[i].result != 0) {
+      ERRORF("could not create %s: %s\n", batch.items[i].path, strerror(-batch.items[i].result));
+      res = 1;
+    }
+  }
+  destroy_io_batch(&batch);
+  return res;
 }
 
-bool is_valid_cpp_config(Config *config)
+// Runs `git init` from PATH. Only used with `gitinit=exec`.
+int exec_git_init(char *root, char *branch)
 {
-  if (config == NULL)
-    return true;
-  
-  ConfigEntry *entry = get_conf_entry(config, "bin");
-  if (entry != NULL && !is_valid_path(entry->value)) {
-    ERRORF("`%s` is not a valid path.\n", entry->value);
-    return false;
+  double start = trace_begin();
+  pid_t pid = fork();
+  if (pid < 0) {
+    ERRORF("could not start git: %s\n", strerror(errno));
+    return 1;
   }
-  entry = get_conf_entry(config, "src");
-  if (entry != NULL && !is_valid_path(entry->value)) {
-    ERRORF("`%s` is not a valid path.\n", entry->value);
-    return false;
+  if (pid == 0) {
+    char *argv[] = { "git", "init", "-q", root, NULL, NULL, NULL };
+    if (branch != NULL) {
+      argv[3] = "-b";
+      argv[4] = branch;
+      argv[5] = root;
+    }
+    execvp(argv[0], argv);
+    _exit(127);
   }
-  return true;
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR)
+      return 1;
+  }
+  trace_end("git_child_process", "git", start, root);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    ERRORF("`git init` failed for %s\n", root);
+    return 1;
+  }
+  return 0;
 }
 
-// This one is tough to implement. You need to have
-// all the python version inside a hashmap and try
-// getting the `str` argument from that hashmap
-// to verify if the version is correct one.
-//
-// I ommit it.
-bool is_valid_pystd(char *str)
+typedef enum {
+  ACTION_ROOT,
+  ACTION_LICENSE,
+  ACTION_GIT,
+  ACTION_SRCDIR,
+  ACTION_BINDIR,
+  ACTION_TEMPLATES,
+  TOTAL_ACTIONS,
+} ActionId;
+
+typedef enum {
+  ACTION_PENDING,
+  ACTION_RUNNING,
+  // The action changed the project and has to be undone on rollback.
+  ACTION_DONE,
+  // The action had nothing to do, e.g. the directory already existed.
+  ACTION_SKIPPED,
+  ACTION_FAILED,
+} ActionState;
+
+// A project being created. Actions run on up to `ctx->jobs` threads and
+// only touch the project through this struct, under `lock` for the
+// scheduling fields. `sink` is the sink of the context, resolving disk
+// paths from `fs` once the root action opened it. `srcdirs` and
+// `bindirs` count the components of those paths that were created.
+typedef struct {
+  ScaffoldContext *ctx;
+  char *root;
+  int lindex;
+  bool *treecreated;
+  OutputSink sink;
+  ProjectFs fs;
+  size_t srcdirs;
+  size_t bindirs;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  ActionState states[TOTAL_ACTIONS];
+  ActionId completed[TOTAL_ACTIONS];
+  size_t ncompleted;
+  bool failed;
+} Project;
+
+#define MAX_ACTION_DEPS 4
+
+typedef struct {
+  const char *name;
+  // Returns ACTION_DONE, ACTION_SKIPPED or ACTION_FAILED.
+  ActionState (*run)(Project *project);
+  void (*undo)(Project *project);
+  ActionId deps[MAX_ACTION_DEPS];
+  size_t ndeps;
+} Action;
+
+// Copies the path of the directory `key` names, relative to the root,
+// into `path` without a leading `./` or `/` and without trailing
+// slashes. Returns false when the language has no such key.
+bool project_dir_path(Project *project, char *key, char path[PATH_MAX])
 {
-  if (str[0] != '3' && str[0] != '2')
+  Config *conf = project->ctx->confs->items[project->lindex];
+  ConfigEntry *entry = get_conf_entry(conf, key);
+  if (entry == NULL)
     return false;
+  const char *value = entry->value;
+  if (value[0] == '/')
+    value++;
+  else if (value[0] == '.' && value[1] == '/')
+    value += 2;
+  size_t len = strlen(value);
+  while (len > 1 && value[len - 1] == '/')
+    len--;
+  if (len == 0) {
+    value = ".";
+    len = 1;
+  }
+  if (len >= PATH_MAX)
+    len = PATH_MAX - 1;
+  memcpy(path, value, len);
+  path[len] = '\0';
   return true;
 }
 
-bool is_valid_py_config(Config *config)
+// Creates the directory `key` names with every missing parent, one
+// component at a time, so nested paths like `src=./src/main/java` work.
+// `created` counts the components that did not exist before.
+ActionState make_project_dir(Project *project, char *key, size_t *created)
 {
-  if (config == NULL)
-    return true;
-  ConfigEntry *entry = get_conf_entry(config, "src");
-  if (entry != NULL && !is_valid_path(entry->value)) {
-    ERRORF("`%s` is not a valid path.\n", entry->value);
+  char path[PATH_MAX];
+  if (!project_dir_path(project, key, path))
+    return ACTION_SKIPPED;
+  char *value = get_conf_entry(project->ctx->confs->items[project->lindex], key)->value;
+  IoBatch batch = { 0 };
+  for (char *p = strchr(path, '/'); p != NULL; p = strchr(p + 1, '/')) {
+    if (p == path || p[-1] == '/') continue;
+    *p = '\0';
+    io_batch_mkdir(&batch, path, 0777);
+    *p = '/';
+  }
+  io_batch_mkdir(&batch, path, 0777);
+  submit_to_sink(&project->sink, &batch);
+
+  ActionState state = ACTION_DONE;
+  *created = 0;
+  for (size_t i = 0; i < batch.size; i++) {
+    int res = batch.items[i].result;
+    if (res == 0)
+      (*created)++;
+    else if (res == -EEXIST && i + 1 == batch.size) {
+      fprintf(stderr, "warning: %s directory already exists.\n", value);
+      state = ACTION_SKIPPED;
+    }
+    else if (res != -EEXIST) {
+      ERRORF("could not create %s directory: %s\n", value, strerror(-res));
+      state = ACTION_FAILED;
+      break;
+    }
+  }
+  if (state == ACTION_FAILED && writes_to_disk(&project->sink)) {
+    for (size_t i = batch.size; i-- > 0; )
+      if (batch.items[i].result == 0)
+        remove_project_path(project->sink.fs, batch.items[i].path);
+  }
+  destroy_io_batch(&batch);
+  return state;
+}
+
+// Removes the last `created` components of the directory `key` names.
+void remove_project_dir(Project *project, char *key, size_t created)
+{
+  char path[PATH_MAX];
+  if (!project_dir_path(project, key, path))
+    return;
+  for (size_t i = 0; i < created; i++) {
+    remove_project_path(project->sink.fs, path);
+    char *slash = strrchr(path, '/');
+    if (slash == NULL)
+      break;
+    while (slash > path && slash[-1] == '/')
+      slash--;
+    *slash = '\0';
+  }
+}
+
+// Archives and snapshots have no root entry, their entries are relative
+// to the root. On disk the root is held open for the other actions.
+ActionState run_root_action(Project *project)
+{
+  if (!writes_to_disk(&project->sink))
+    return ACTION_SKIPPED;
+  ActionState state = ACTION_DONE;
+  if (make_parent_dirs(project->root) != 0 || mkdir(project->root, 0777) != 0) {
+    if (errno != EEXIST) {
+      ERRORF("could not create %s directory: %s\n", project->root, strerror(errno));
+      return ACTION_FAILED;
+    }
+    state = ACTION_SKIPPED;
+  }
+  int res = open_project_fs(&project->fs, project->root);
+  if (res != 0) {
+    ERRORF("could not open %s directory: %s\n", project->root, strerror(-res));
+    if (state == ACTION_DONE)
+      remove(project->root);
+    return ACTION_FAILED;
+  }
+  project->sink.fs = &project->fs;
+  return state;
+}
+
+void undo_root_action(Project *project)
+{
+  remove(project->root);
+}
+
+ActionState run_license_action(Project *project)
+{
+  ScaffoldContext *ctx = project->ctx;
+  if (ctx->license == NULL)
+    return ACTION_SKIPPED;
+  IoBatch batch = { 0 };
+  io_batch_template(&batch, ctx->license, &ctx->placeholders, "LICENSE", O_TRUNC, 0666);
+  submit_to_sink(&project->sink, &batch);
+  int res = batch.items[0].result;
+  if (res != 0) {
+    ERRORF("could not write %s/LICENSE: %s\n", project->root, strerror(-res));
+    if (writes_to_disk(&project->sink))
+      remove_project_path(project->sink.fs, "LICENSE");
+  }
+  destroy_io_batch(&batch);
+  return res == 0 ? ACTION_DONE : ACTION_FAILED;
+}
+
+void undo_license_action(Project *project)
+{
+  remove_project_path(project->sink.fs, "LICENSE");
+}
+
+ActionState run_git_action(Project *project)
+{
+  Config *conf = project->ctx->confs->items[GLOBAL_CONFIG];
+  ConfigEntry *entry = get_conf_entry(conf, "gitrepo");
+  if (entry == NULL || !ISSTREQ(entry->value, "true"))
+    return ACTION_SKIPPED;
+
+  OutputSink *sink = &project->sink;
+  struct stat st;
+  if (writes_to_disk(sink) && fstatat(project->fs.fd, ".git", &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "warning: git repository already initialized.\n");
+    return ACTION_SKIPPED;
+  }
+  entry = get_conf_entry(conf, "gitbranch");
+  char *branch = entry != NULL ? entry->value : NULL;
+  // git can only write to the disk, archives and snapshots always get
+  // the builtin layout.
+  entry = get_conf_entry(conf, "gitinit");
+  int res = writes_to_disk(sink) && entry != NULL && ISSTREQ(entry->value, "exec")
+    ? exec_git_init(project->root, branch)
+    : init_git_repository(branch, sink);
+  if (res != 0 && writes_to_disk(sink))
+    remove_tree_at(project->fs.fd, ".git");
+  return res == 0 ? ACTION_DONE : ACTION_FAILED;
+}
+
+void undo_git_action(Project *project)
+{
+  remove_tree_at(project->fs.fd, ".git");
+}
+
+ActionState run_srcdir_action(Project *project)
+{
+  return make_project_dir(project, "src", &project->srcdirs);
+}
+
+void undo_srcdir_action(Project *project)
+{
+  remove_project_dir(project, "src", project->srcdirs);
+}
+
+ActionState run_bindir_action(Project *project)
+{
+  return make_project_dir(project, "bin", &project->bindirs);
+}
+
+void undo_bindir_action(Project *project)
+{
+  remove_project_dir(project, "bin", project->bindirs);
+}
+
+ActionState run_templates_action(Project *project)
+{
+  TemplateTree *tree = project->ctx->trees[project->lindex];
+  if (tree->size == 0)
+    return ACTION_SKIPPED;
+  project->treecreated = calloc(tree->size, sizeof(bool));
+  int res = copy_template_tree(tree, &project->ctx->placeholders, project->treecreated, &project->sink);
+  return res == 0 ? ACTION_DONE : ACTION_FAILED;
+}
+
+void undo_templates_action(Project *project)
+{
+  remove_template_tree(project->ctx->trees[project->lindex], project->treecreated, project->sink.fs);
+}
+
+// The steps of creating a project. Everything needs the root directory.
+// The template tree may contain the source and binary directories or a
+// LICENSE of its own, so it waits for those; git init is independent of
+// everything but the root.
+const Action actions[TOTAL_ACTIONS] = {
+  [ACTION_ROOT]      = { "root",      run_root_action,      undo_root_action,      { 0 }, 0 },
+  [ACTION_LICENSE]   = { "license",   run_license_action,   undo_license_action,   { ACTION_ROOT }, 1 },
+  [ACTION_GIT]       = { "git",       run_git_action,       undo_git_action,       { ACTION_ROOT }, 1 },
+  [ACTION_SRCDIR]    = { "srcdir",    run_srcdir_action,    undo_srcdir_action,    { ACTION_ROOT }, 1 },
+  [ACTION_BINDIR]    = { "bindir",    run_bindir_action,    undo_bindir_action,    { ACTION_ROOT }, 1 },
+  [ACTION_TEMPLATES] = { "templates", run_templates_action, undo_templates_action,
+                         { ACTION_LICENSE, ACTION_SRCDIR, ACTION_BINDIR }, 3 },
+};
+
+bool is_action_ready(Project *project, ActionId id)
+{
+  if (project->states[id] != ACTION_PENDING)
     return false;
+  for (size_t i = 0; i < actions[id].ndeps; i++) {
+    ActionState dep = project->states[actions[id].deps[i]];
+    if (dep != ACTION_DONE && dep != ACTION_SKIPPED)
+      return false;
   }
   return true;
 }
 
-Configs *get_configs()
+// Runs ready actions until none is left. Waits while other threads are
+// still running actions that may unblock new ones.
+void *action_worker(void *arg)
 {
-  return parse_config(lex_config());
+  Project *project = arg;
+  pthread_mutex_lock(&project->lock);
+  for (;;) {
+    if (project->failed)
+      break;
+    int next = -1;
+    bool running = false;
+    for (int id = 0; id < TOTAL_ACTIONS; id++) {
+      if (project->states[id] == ACTION_RUNNING)
+        running = true;
+      else if (next == -1 && is_action_ready(project, id))
+        next = id;
+    }
+    if (next == -1) {
+      if (!running)
+        break;
+      pthread_cond_wait(&project->cond, &project->lock);
+      continue;
+    }
+
+    project->states[next] = ACTION_RUNNING;
+    pthread_mutex_unlock(&project->lock);
+    double start = trace_begin();
+    ActionState state = actions[next].run(project);
+    trace_end(actions[next].name, "action", start, project->root);
+    pthread_mutex_lock(&project->lock);
+    project->states[next] = state;
+    if (state == ACTION_DONE)
+      project->completed[project->ncompleted++] = next;
+    else if (state == ACTION_FAILED)
+      project->failed = true;
+    pthread_cond_broadcast(&project->cond);
+  }
+  pthread_mutex_unlock(&project->lock);
+  return NULL;
 }
 
-int verify_config()
+// A command of a language's `hook=` list, run through the shell in a
+// new project. Its output goes to the file at `log`. `pidfd` is -1 when
+// the kernel has no pidfd_open, the hook is then waited for by its pid.
+typedef struct {
+  char *command;
+  char *log;
+  pid_t pid;
+  int pidfd;
+  int status;
+  double start;
+} Hook;
+
+typedef struct {
+  Hook *items;
+  size_t size;
+  size_t capacity;
+} Hooks;
+
+int add_hook(void *ctx, const char *command, size_t len)
 {
-  Configs *confs = get_configs();
-  if (confs == NULL)
-    return 1;
+  Hooks *hooks = ctx;
+  if (hooks->size >= hooks->capacity) {
+    hooks->capacity = hooks->capacity == 0 ? 4 : hooks->capacity * 2;
+    hooks->items = realloc(hooks->items, sizeof(Hook) * hooks->capacity);
+  }
+  hooks->items[hooks->size++] = (Hook) { .command = strndup(command, len), .log = NULL, .pid = -1, .pidfd = -1 };
+  return 0;
+}
 
-  if (!is_valid_core_config(confs->items[GLOBAL_CONFIG])) return 1;
-  if (!is_valid_clang_config(confs->items[CLANG_CONFIG])) return 1;
-  if (!is_valid_cpp_config(confs->items[CPP_CONFIG])) return 1;
-  if (!is_valid_py_config(confs->items[PYTHON_CONFIG])) return 1;
+// Starts `hook` in `root` with posix_spawn, which does not copy the
+// address space the way fork does, with its output going to its log.
+// Returns 0 or a negated errno.
+int spawn_hook(Hook *hook, const char *root)
+{
+  int fd = open(hook->log, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return -errno;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, fd, STDERR_FILENO);
+  posix_spawn_file_actions_addchdir_np(&actions, root);
+  // Archives ignore SIGPIPE, hooks get the default back.
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t signals;
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  sigaddset(&signals, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
 
+  char *argv[] = { "sh", "-c", hook->command, NULL };
+  hook->start = trace_begin();
+  int res = posix_spawn(&hook->pid, "/bin/sh", &actions, &attr, argv, environ);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fd);
+  if (res != 0) {
+    hook->pid = -1;
+    return -res;
+  }
+  hook->pidfd = syscall(SYS_pidfd_open, hook->pid, 0);
   return 0;
 }
 
-int handle_verify_config()
+// Waits for the hook to exit and reports it unless it exited with
+// status 0, in which case it returns 0.
+int reap_hook(Hook *hook)
 {
-  int status = verify_config();
-  if (status == 0) {
-    printf("Config contains no errors.\n");
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(hook->pid, &status, 0)) < 0 && errno == EINTR)
+    ;
+  if (hook->pidfd >= 0)
+    close(hook->pidfd);
+  hook->pidfd = -1;
+  hook->pid = -1;
+  trace_end("hook", "hook", hook->start, hook->command);
+  if (pid < 0) {
+    ERRORF("could not wait for hook `%s`: %s\n", hook->command, strerror(errno));
+    return 1;
+  }
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
     return 0;
+  if (WIFEXITED(status)) {
+    ERRORF("hook `%s` exited with status %d, see %s\n", hook->command, WEXITSTATUS(status), hook->log);
+  }
+  else {
+    ERRORF("hook `%s` was killed by signal %d, see %s\n", hook->command, WTERMSIG(status), hook->log);
   }
   return 1;
 }
 
-int handle_config_command(int argc, char **argv)
+// Runs the hooks in `root` in order, up to `jobs` at a time, and waits
+// for each by its own pid, so child processes started elsewhere are never
+// reaped here. Hooks that exit are noticed through their pidfds; without
+// pidfd support the oldest running hook is waited for instead. Once a
+// hook fails no more are started. Returns 1 if a hook could not be
+// started or did not exit with status 0.
+int run_hooks(Hooks *hooks, const char *root, size_t jobs)
 {
-  bool verified = false;
-  bool found = false;
-
-  for (int i = 2; i < argc; i++) {
-    char *arg = argv[i];
-    if (arg[0] != '-') {
-      ERRORF("Unknown flag `%s`.\n", arg);
-      return 1;
+  if (jobs == 0)
+    jobs = 1;
+  int res = 0;
+  size_t next = 0;
+  size_t running = 0;
+  struct pollfd *fds = malloc(sizeof(struct pollfd) * jobs);
+  Hook **polled = malloc(sizeof(Hook *) * jobs);
+  while ((res == 0 && next < hooks->size) || running > 0) {
+    for (; res == 0 && next < hooks->size && running < jobs; next++) {
+      Hook *hook = &hooks->items[next];
+      int err = spawn_hook(hook, root);
+      if (err != 0) {
+        ERRORF("could not run hook `%s`: %s\n", hook->command, strerror(-err));
+        res = 1;
+        continue;
+      }
+      running++;
     }
-    // Skip dashes
-    arg += arg[1] == '-' ? 2 : 1;
+    if (running == 0)
+      break;
 
-    if (ISSTREQ(arg, "verify") || ISSTREQ(arg, "v")) {
-      if (verified) continue;
-      if (handle_verify_config() != 0)
-        return 1;
-      verified = true;
+    size_t nfds = 0;
+    Hook *oldest = NULL;
+    for (size_t i = 0; i < next; i++) {
+      Hook *hook = &hooks->items[i];
+      if (hook->pid < 0) continue;
+      if (oldest == NULL)
+        oldest = hook;
+      if (hook->pidfd >= 0) {
+        fds[nfds] = (struct pollfd) { .fd = hook->pidfd, .events = POLLIN };
+        polled[nfds++] = hook;
+      }
     }
-    else if (ISSTREQ(arg, "where") || ISSTREQ(arg, "w")) {
-      if (found) continue;
-      if (handle_where_config() != 0)
-        return 1;
-      found = true;
+    if (nfds < running) {
+      res |= reap_hook(oldest);
+      running--;
+      continue;
     }
-    else {
-      ERRORF("Unknown flag `%s`.\n", arg);
-      return 1;
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) continue;
+      // Without a way to tell which hook exited, wait for them in order.
+      for (size_t i = 0; i < nfds; i++)
+        res |= reap_hook(polled[i]);
+      running = 0;
+      continue;
+    }
+    for (size_t i = 0; i < nfds; i++) {
+      if (fds[i].revents == 0) continue;
+      res |= reap_hook(polled[i]);
+      running--;
     }
   }
-  return 0;
+  free(fds);
+  free(polled);
+  return res;
 }
 
-#define MAX_CWD_SIZE 2048
-
-int get_lang_index(char *lang)
+void destroy_hooks(Hooks *hooks)
 {
-  if (ISSTREQ(lang, "c") || ISSTREQ(lang, "clang"))
-    return CLANG_CONFIG;
-  if (ISSTREQ(lang, "c++") || ISSTREQ(lang, "cpp"))
-    return CPP_CONFIG;
-  if (ISSTREQ(lang, "py"))
-    return PYTHON_CONFIG;
-  return -1;
+  for (size_t i = 0; i < hooks->size; i++) {
+    free(hooks->items[i].command);
+    free(hooks->items[i].log);
+  }
+  free(hooks->items);
 }
 
-char *concat_path_file(char *path, char *file)
+// Runs the `hook=` commands of the language at `lindex` in the project
+// at `root`, one after the other, or up to `ctx->jobs` at once when the
+// language sets `parallelhooks`. Each hook logs to its own file in a
+// directory of its own under `~/.cache/boiling/hooks`, which is removed
+// again when every hook succeeded.
+int run_language_hooks(ScaffoldContext *ctx, int lindex, char *root)
 {
-  char *str = malloc(MAX_CWD_SIZE + MAX_VALUE_LEN);
-  size_t pathlen = strlen(path);
-  strncpy(str, path, pathlen);
-  str[pathlen++] = '/';
+  ConfigEntry *entry = get_conf_entry(ctx->confs->items[lindex], "hook");
+  if (entry == NULL)
+    return 0;
+  Hooks hooks = { 0 };
+  for_each_list_item(entry->value, add_hook, &hooks);
+  if (hooks.size == 0)
+    return 0;
 
-  if (file[0] == '/')
-    file++;
-  else if (file[0] == '.' && file[1] == '/')
-    file += 2;
-  strncpy(str + pathlen, file, strlen(file) + 1);
+  char *cachedir = find_cache_dir();
+  const char *base = strrchr(root, '/');
+  base = base != NULL && base[1] != '\0' ? base + 1 : root;
+  char logdir[PATH_MAX];
+  snprintf(logdir, sizeof(logdir), "%s/hooks/%s-XXXXXX", cachedir != NULL ? cachedir : "/tmp", base);
+  free(cachedir);
+  if (make_parent_dirs(logdir) != 0 || mkdtemp(logdir) == NULL) {
+    ERRORF("could not create the hook log directory %s: %s\n", logdir, strerror(errno));
+    destroy_hooks(&hooks);
+    return 1;
+  }
+  for (size_t i = 0; i < hooks.size; i++) {
+    hooks.items[i].log = malloc(strlen(logdir) + 32);
+    sprintf(hooks.items[i].log, "%s/%zu.log", logdir, i);
+  }
 
-  return str;
+  entry = get_conf_entry(ctx->confs->items[lindex], "parallelhooks");
+  size_t jobs = entry != NULL && ISSTREQ(entry->value, "true") ? ctx->jobs : 1;
+  double start = trace_begin();
+  int res = run_hooks(&hooks, root, jobs);
+  trace_end("run_hooks", "hook", start, root);
+  if (res == 0) {
+    for (size_t i = 0; i < hooks.size; i++)
+      unlink(hooks.items[i].log);
+    rmdir(logdir);
+  }
+  destroy_hooks(&hooks);
+  return res;
 }
 
-int copy_and_replace_placeholders(char *src, char *dst, char *name)
+// Creates a project of language `lang` inside the `root` directory.
+// `ctx` is only read, so one context can be shared between several
+// projects created at the same time. If any action fails, every action
+// that completed is undone in reverse order of completion, unless the
+// project went into an archive or a snapshot. The language's hooks run
+// last, see run_language_hooks.
+int create_new_project(ScaffoldContext *ctx, char *root, char *lang)
 {
-  FILE *f = fopen(src, "r");
-  if (f == NULL)
+  int lindex = get_lang_index(ctx->confs, lang);
+  if (lindex == -1) {
+    ERRORF("`%s` is not a supported language.\n", lang);
     return 1;
-  fseek(f, 0, SEEK_END);
-  int bytes = ftell(f);
-  fseek(f, 0, SEEK_SET);
-  
-  char *content = malloc(bytes + 1);
-  char c;
-  int i = 0;
-  while ((c = getc(f)) != EOF)
-    content[i++] = c;
-  content[i] = '\0';
+  }
 
-  fclose(f);
+  double start = trace_begin();
+  Project project = { .ctx = ctx, .root = root, .lindex = lindex, .treecreated = NULL, .sink = ctx->sink };
+  project.fs.fd = -1;
+  project.srcdirs = project.bindirs = 0;
+  for (size_t i = 0; i < TOTAL_ACTIONS; i++)
+    project.states[i] = ACTION_PENDING;
+  project.ncompleted = 0;
+  project.failed = false;
+  pthread_mutex_init(&project.lock, NULL);
+  pthread_cond_init(&project.cond, NULL);
 
-  f = fopen(dst, "w");
-  for (int i = 0; i < bytes + 1; i++) {
-    if (content[i] == '[') {
-      assert(i + 1 < bytes + 1);
-      if (content[++i] == '[') {
-        int start = i + 1;
-        while (content[i] != '\0' && content[i] != '\n' && content[i] != ']')
-          i++;
-        if (content[i] == '\0' || content[i] == '\n') {
-          ERROR("Incorrect placeholder formatting for the license: reached end of the line or end of file.");
-          return 1;
-        }
-        assert(i + 1 < bytes + 1);
-        if (content[++i] != ']') {
-          ERROR("Incorrect placeholder formatting for the license: placeholder closed with one ']', expected two.");
-          return 1;
-        }
-        char placeholder[64];
-        size_t n = i - start - 1;
-        strncpy(placeholder, content + start, n);
-        placeholder[n] = '\0';
-        if (ISSTREQ(placeholder, "Name"))
-          fprintf(f, "%s", name);
-        else if (ISSTREQ(placeholder, "Year")) {
-          time_t now = time(NULL);
-          struct tm *curtime = localtime(&now);
-          fprintf(f, "%d", curtime->tm_year + 1900);
-        }
-        else {
-          ERRORF("Unknown placeholder `%s`\n", placeholder);
-          return 1;
-        }
-      }
-      else {
-        fputc('[', f);
-        fputc(content[i], f);
-      }
+  size_t jobs = ctx->jobs < TOTAL_ACTIONS ? ctx->jobs : TOTAL_ACTIONS;
+  pthread_t threads[TOTAL_ACTIONS];
+  size_t started = 0;
+  for (size_t i = 1; i < jobs; i++) {
+    if (pthread_create(&threads[started], NULL, action_worker, &project) != 0)
+      break;
+    started++;
+  }
+  action_worker(&project);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  // Entries already streamed into an archive or recorded in a snapshot
+  // stay, the caller discards them.
+  if (project.failed && writes_to_disk(&ctx->sink)) {
+    while (project.ncompleted-- > 0)
+      actions[project.completed[project.ncompleted]].undo(&project);
+  }
+  close_project_fs(&project.fs);
+
+  free(project.treecreated);
+  pthread_cond_destroy(&project.cond);
+  pthread_mutex_destroy(&project.lock);
+  trace_end("create_new_project", "project", start, root);
+  if (project.failed)
+    return 1;
+  // Hooks run once the project is complete and only on disk. A failing
+  // hook fails the command, but the project is kept: what the hooks did
+  // to it cannot be undone.
+  return writes_to_disk(&ctx->sink) ? run_language_hooks(ctx, lindex, root) : 0;
+}
+
+#define MAX_PROJECT_NAME_LEN 128
+#define MAX_LANG_NAME_LEN    64
+#define MAX_MANIFEST_LINE    4096
+
+typedef struct {
+  char *dir;
+  char *lang;
+  char *name;
+  size_t line;
+  int status;
+  double seconds;
+} BatchProject;
+
+typedef struct {
+  BatchProject *items;
+  size_t size;
+  size_t capacity;
+} BatchProjects;
+
+typedef struct {
+  BatchProjects *projects;
+  ScaffoldContext *scaffold;
+} BatchContext;
+
+void destroy_batch_projects(BatchProjects *projects)
+{
+  for (size_t i = 0; i < projects->size; i++) {
+    free(projects->items[i].dir);
+    free(projects->items[i].lang);
+    free(projects->items[i].name);
+  }
+  free(projects->items);
+  free(projects);
+}
+
+// A manifest holds one project per line: `<directory> <lang> [<name>]`.
+// Empty lines and lines starting with `#` are skipped. The name defaults
+// to the last component of the directory.
+BatchProjects *load_manifest(char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    ERRORF("could not open manifest %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  BatchProjects *projects = malloc(sizeof(BatchProjects));
+  projects->capacity = 32;
+  projects->size = 0;
+  projects->items = malloc(sizeof(BatchProject) * projects->capacity);
+
+  char line[MAX_MANIFEST_LINE];
+  size_t lineno = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    char *fields[4] = { NULL };
+    size_t nfields = 0;
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t\r\n", &save);
+    while (tok != NULL && tok[0] != '#' && nfields < 4) {
+      fields[nfields++] = tok;
+      tok = strtok_r(NULL, " \t\r\n", &save);
+    }
+    if (nfields == 0)
+      continue;
+    if (nfields < 2 || nfields > 3) {
+      ERRORF("%s:%zu: expected `<directory> <lang> [<name>]`.\n", path, lineno);
+      fclose(f);
+      destroy_batch_projects(projects);
+      return NULL;
+    }
+    if (strlen(fields[1]) + 1 > MAX_LANG_NAME_LEN ||
+        (nfields == 3 && strlen(fields[2]) + 1 > MAX_PROJECT_NAME_LEN)) {
+      ERRORF("%s:%zu: language or project name is too long.\n", path, lineno);
+      fclose(f);
+      destroy_batch_projects(projects);
+      return NULL;
+    }
+    char *name = fields[2];
+    if (name == NULL) {
+      name = strrchr(fields[0], '/');
+      name = name != NULL && name[1] != '\0' ? name + 1 : fields[0];
+    }
+
+    if (projects->size >= projects->capacity) {
+      projects->capacity *= 2;
+      projects->items = realloc(projects->items, sizeof(BatchProject) * projects->capacity);
     }
-    else fputc(content[i], f);
+    projects->items[projects->size++] = (BatchProject) {
+      .dir = strdup(fields[0]),
+      .lang = strdup(fields[1]),
+      .name = strdup(name),
+      .line = lineno,
+      .status = 0,
+      .seconds = 0,
+    };
   }
   fclose(f);
+  return projects;
+}
 
-  return 0;
+void create_batch_project(void *ctx, size_t index)
+{
+  BatchContext *batch = ctx;
+  BatchProject *project = &batch->projects->items[index];
+  double start = now_seconds();
+  project->status = create_new_project(batch->scaffold, project->dir, project->lang);
+  project->seconds = now_seconds() - start;
+  printf("%-4s %s (%s, %s) %.3fms\n", project->status == 0 ? "ok" : "FAIL",
+         project->name, project->lang, project->dir, project->seconds * 1000);
 }
 
-int create_new_project(char *lang)
+int create_batch(char *manifest, size_t jobs, IoBackend io)
 {
-  int retval = 0;
-  int lindex = get_lang_index(lang);
-  if (lindex == -1) {
-    ERRORF("`%s` is not a supported language.\n", lang);
+  double start = now_seconds();
+  BatchProjects *projects = load_manifest(manifest);
+  if (projects == NULL)
+    return 1;
+
+  ScaffoldContext *scaffold = open_scaffold();
+  if (scaffold == NULL) {
+    destroy_batch_projects(projects);
     return 1;
   }
-
-  bool repoed = false;
-  bool copiedlicense = false;
-  bool createdsrcdir = false;
-  bool createdbindir = false;
-
-  char cwd[MAX_CWD_SIZE];
-  getcwd(cwd, MAX_CWD_SIZE);
-  Configs *confs = get_configs();
-  extern char **environ;
-
-  Config *conf = confs->items[GLOBAL_CONFIG];
-  ConfigEntry *entry = get_conf_entry(conf, "name");
-  char *name = NULL;
-  if (entry != NULL)
-    name = entry->value;
-
-  char *confpath = find_config();
-  confpath[strlen(confpath) - 13] = '\0';
-  if (confpath != NULL) {
-    char *src = concat_path_file(confpath, "LICENSE");
-    char *dst = concat_path_file(cwd, "LICENSE");
-    int res = copy_and_replace_placeholders(src, dst, name);
-    if (res != 0) {
-      remove(dst);
-      free(src);
-      free(dst);
-      free(confpath);
-      retval = 1;
-      goto cleanup;
+  for (size_t i = 0; i < projects->size; i++) {
+    if (get_lang_index(scaffold->confs, projects->items[i].lang) == -1) {
+      ERRORF("%s:%zu: `%s` is not a supported language.\n", manifest,
+             projects->items[i].line, projects->items[i].lang);
+      close_scaffold(scaffold);
+      destroy_batch_projects(projects);
+      return 1;
     }
-    free(src);
-    free(dst);
-    free(confpath);
-    copiedlicense = true;
   }
-
-  entry = get_conf_entry(conf, "gitrepo");
-  if (entry != NULL && ISSTREQ(entry->value, "true")) {
-    char *path = concat_path_file(cwd, ".git");
-    if (is_dir(path))
-      fprintf(stderr, "warning: git repository already initialized.\n");
-    else {
-      pid_t pid = fork();
-      if (pid == 0) {
-        char *argv[] = { "/usr/bin/git", "init", NULL };
-        execve(argv[0], argv, environ);
-        retval = 1;
-        goto cleanup;
-      }
-      else {
-        siginfo_t info;
-        waitid(P_ALL, 0, &info, WEXITED);
-      }
-      repoed = true;
+  scaffold->sink.io = io;
+  for (size_t i = 0; i < projects->size; i++) {
+    if (load_scaffold_language(scaffold, get_lang_index(scaffold->confs, projects->items[i].lang)) != 0) {
+      close_scaffold(scaffold);
+      destroy_batch_projects(projects);
+      return 1;
     }
-    free(path);
   }
+  BatchContext batch = { .projects = projects, .scaffold = scaffold };
+  parallel_for(projects->size, jobs, create_batch_project, &batch);
 
-  conf = confs->items[lindex];
-  entry = get_conf_entry(conf, "src");
-  if (entry != NULL) {
-    char *path = concat_path_file(cwd, entry->value);
-    int res = mkdir(path, 0777);
-    free(path);
-    if (res != 0) {
-      if (errno == EEXIST) {
-        fprintf(stderr, "warning: %s directory already exists.\n", entry->value);
-      }
-      else {
-        ERRORF("could not create %s directory: %s\n", entry->value, strerror(errno));
-        retval = 1;
-        goto cleanup;
-      }
-    }
-    else createdsrcdir = true;
-  }
+  size_t failed = 0;
+  for (size_t i = 0; i < projects->size; i++)
+    if (projects->items[i].status != 0)
+      failed++;
+  printf("%zu projects: %zu succeeded, %zu failed in %.3fs (%zu jobs)\n",
+         projects->size, projects->size - failed, failed, now_seconds() - start,
+         jobs < projects->size ? jobs : projects->size);
 
-  entry = get_conf_entry(conf, "bin");
-  if (entry != NULL) {
-    char *path = concat_path_file(cwd, entry->value);
-    int res = mkdir(path, 0777);
-    free(path);
-    if (res != 0) {
-      if (errno == EEXIST) {
-        fprintf(stderr, "warning: %s directory already exists.\n", entry->value);
-      }
-      else {
-        ERRORF("could not create %s directory: %s\n", entry->value, strerror(errno));
-        retval = 1;
-        goto cleanup;
-      }
-    }
-    else createdbindir = true;
-  }
-  goto finish;
+  close_scaffold(scaffold);
+  destroy_batch_projects(projects);
+  return failed == 0 ? 0 : 1;
+}
 
-cleanup:
-  if (repoed) {
-    char *path = concat_path_file(cwd, ".git");
-    remove(path);
-    free(path);
+// Creates the project recorded in the snapshot image at `path` in the
+// current directory, or into the archive at `archive`. No config is
+// loaded: the placeholders set in `values` are used, the year is the
+// current one and the rest keep the values the snapshot was taken with.
+int create_from_snapshot(char *path, Placeholders *values, char *archive, bool zstd, IoBackend io)
+{
+  char cwd[MAX_CWD_SIZE];
+  if (getcwd(cwd, MAX_CWD_SIZE) == NULL) {
+    ERRORF("could not get current directory: %s\n", strerror(errno));
+    return 1;
   }
-  if (copiedlicense) {
-    char *path = concat_path_file(cwd, "LICENSE");
-    remove(path);
-    free(path);
+  Snapshot *snap = open_snapshot(path);
+  if (snap == NULL)
+    return 1;
+  if (values->values[PLACEHOLDER_YEAR] == NULL)
+    resolve_year_placeholder(values);
+
+  OutputSink sink = { .io = io, .tar = NULL, .snapshot = NULL, .fs = NULL };
+  if (archive != NULL && (sink.tar = open_tar_stream(archive, zstd)) == NULL) {
+    close_snapshot(snap);
+    return 1;
   }
-  if (createdsrcdir) {
-    entry = get_conf_entry(conf, "src");
-    char *path = concat_path_file(cwd, entry->value);
-    remove(path);
-    free(path);
+  ProjectFs fs = { .fd = -1 };
+  if (archive == NULL) {
+    int res = open_project_fs(&fs, cwd);
+    if (res != 0) {
+      ERRORF("could not open %s directory: %s\n", cwd, strerror(-res));
+      close_snapshot(snap);
+      return 1;
+    }
+    sink.fs = &fs;
   }
-  if (createdbindir) {
-    entry = get_conf_entry(conf, "bin");
-    char *path = concat_path_file(cwd, entry->value);
-    remove(path);
-    free(path);
+  int retval = materialize_snapshot(snap, values, cwd, &sink);
+  close_project_fs(&fs);
+  if (archive != NULL) {
+    if (close_tar_stream(sink.tar) != 0)
+      retval = 1;
+    if (retval != 0 && !ISSTREQ(archive, "-"))
+      unlink(archive);
   }
-finish:
-  for (size_t i = 0; i < confs->capacity; i++)
-    destroy_config(confs->items[i]);
-  free(confs->items);
-  free(confs);
+  close_snapshot(snap);
   return retval;
 }
 
-#define MAX_PROJECT_NAME_LEN 128
-#define MAX_LANG_NAME_LEN    64
-
 int handle_new_command(int argc, char **argv)
 {
   bool named = false;
   bool languaged = false;
+  bool batched = false;
 
   char name[MAX_PROJECT_NAME_LEN];
   char lang[MAX_LANG_NAME_LEN];
+  char *manifest = NULL;
+  char *archive = NULL;
+  bool zstd = false;
+  char *snapshot = NULL;
+  Placeholders values = { 0 };
+  bool setvalues = false;
+  size_t jobs = default_jobs();
+  IoBackend io = IO_SYNC;
 
   for (int i = 2; i < argc; i++) {
     char *arg = argv[i];
@@ -864,16 +5719,280 @@ int handle_new_command(int argc, char **argv)
       strncpy(lang, arg, MAX_LANG_NAME_LEN);
       languaged = true;
     }
+    else if (ISSTREQ(arg, "batch") || ISSTREQ(arg, "b")) {
+      if (batched) continue;
+      if (i + 1 >= argc) {
+        ERROR("No value specified for `batch` flag.");
+        return 1;
+      }
+      manifest = argv[++i];
+      batched = true;
+    }
+    else if (ISSTREQ(arg, "emit-archive")) {
+      if (i + 1 >= argc) {
+        ERROR("No value specified for `emit-archive` flag.");
+        return 1;
+      }
+      archive = argv[++i];
+    }
+    else if (ISSTREQ(arg, "zstd"))
+      zstd = true;
+    else if (ISSTREQ(arg, "from-snapshot")) {
+      if (i + 1 >= argc) {
+        ERROR("No value specified for `from-snapshot` flag.");
+        return 1;
+      }
+      snapshot = argv[++i];
+    }
+    else if (ISSTREQ(arg, "set")) {
+      if (i + 1 >= argc) {
+        ERROR("No value specified for `set` flag.");
+        return 1;
+      }
+      char *value = argv[++i];
+      char *eq = strchr(value, '=');
+      int placeholder = -1;
+      for (int p = 0; eq != NULL && p < TOTAL_PLACEHOLDERS; p++)
+        if (strlen(placeholder_names[p]) == (size_t) (eq - value) && memcmp(placeholder_names[p], value, eq - value) == 0)
+          placeholder = p;
+      if (placeholder == -1) {
+        ERRORF("`%s` does not set a placeholder. Expected <Placeholder>=<value>.\n", value);
+        return 1;
+      }
+      values.values[placeholder] = eq + 1;
+      setvalues = true;
+    }
+    else if (ISSTREQ(arg, "jobs") || ISSTREQ(arg, "j")) {
+      if (i + 1 >= argc) {
+        ERROR("No value specified for `jobs` flag.");
+        return 1;
+      }
+      char *end;
+      long n = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || n < 1) {
+        ERRORF("`%s` is not a valid number of jobs.\n", argv[i]);
+        return 1;
+      }
+      jobs = n;
+    }
+    else if (ISSTREQ(arg, "io") || strncmp(arg, "io=", 3) == 0) {
+      char *value = arg[2] == '=' ? arg + 3 : NULL;
+      if (value == NULL) {
+        if (i + 1 >= argc) {
+          ERROR("No value specified for `io` flag.");
+          return 1;
+        }
+        value = argv[++i];
+      }
+      if (ISSTREQ(value, "uring"))
+        io = IO_URING;
+      else if (ISSTREQ(value, "sync"))
+        io = IO_SYNC;
+      else {
+        ERRORF("Unknown io backend `%s`. Expected `uring` or `sync`.\n", value);
+        return 1;
+      }
+    }
+    else {
+      ERRORF("Unknown flag `%s`.\n", arg);
+      return 1;
+    }
+  }
+
+  if (zstd && archive == NULL) {
+    ERROR("`--zstd` needs `--emit-archive`.");
+    return 1;
+  }
+  if (batched && archive != NULL) {
+    ERROR("`--emit-archive` cannot be combined with `--batch`.");
+    return 1;
+  }
+  if (batched && snapshot != NULL) {
+    ERROR("`--from-snapshot` cannot be combined with `--batch`.");
+    return 1;
+  }
+  if (setvalues && snapshot == NULL) {
+    ERROR("`--set` needs `--from-snapshot`.");
+    return 1;
+  }
+  if (snapshot != NULL)
+    return create_from_snapshot(snapshot, &values, archive, zstd, io);
+  if (batched)
+    return create_batch(manifest, jobs, io);
+  if (!languaged) {
+    ERROR("No language specified. Use `--lang` flag.");
+    return 1;
+  }
+
+  char cwd[MAX_CWD_SIZE];
+  if (getcwd(cwd, MAX_CWD_SIZE) == NULL) {
+    ERRORF("could not get current directory: %s\n", strerror(errno));
+    return 1;
+  }
+  ScaffoldContext *scaffold = open_scaffold();
+  if (scaffold == NULL)
+    return 1;
+  scaffold->jobs = jobs;
+  scaffold->sink.io = io;
+  int lindex = get_lang_index(scaffold->confs, lang);
+  if (lindex != -1 && load_scaffold_language(scaffold, lindex) != 0) {
+    close_scaffold(scaffold);
+    return 1;
+  }
+  if (archive != NULL) {
+    scaffold->sink.tar = open_tar_stream(archive, zstd);
+    if (scaffold->sink.tar == NULL) {
+      close_scaffold(scaffold);
+      return 1;
+    }
+  }
+  int retval = create_new_project(scaffold, cwd, lang);
+  if (archive != NULL) {
+    if (close_tar_stream(scaffold->sink.tar) != 0)
+      retval = 1;
+    scaffold->sink.tar = NULL;
+    if (retval != 0 && !ISSTREQ(archive, "-"))
+      unlink(archive);
+  }
+  close_scaffold(scaffold);
+  return retval;
+}
+
+// `boiling snapshot -l <lang> -o <file>` creates a project of `lang` the
+// usual way, but records it into a snapshot image instead of writing it.
+int handle_snapshot_command(int argc, char **argv)
+{
+  char *lang = NULL;
+  char *output = NULL;
+  for (int i = 2; i < argc; i++) {
+    char *arg = argv[i];
+    char **value = NULL;
+    if (ISSTREQ(arg, "--lang") || ISSTREQ(arg, "-l"))
+      value = &lang;
+    else if (ISSTREQ(arg, "--output") || ISSTREQ(arg, "-o"))
+      value = &output;
     else {
       ERRORF("Unknown flag `%s`.\n", arg);
       return 1;
     }
+    if (i + 1 >= argc) {
+      ERRORF("No value specified for `%s` flag.\n", arg);
+      return 1;
+    }
+    *value = argv[++i];
+  }
+  if (lang == NULL || output == NULL) {
+    ERROR("`snapshot` needs `--lang` and `--output`.");
+    return 1;
+  }
+
+  char cwd[MAX_CWD_SIZE];
+  if (getcwd(cwd, MAX_CWD_SIZE) == NULL) {
+    ERRORF("could not get current directory: %s\n", strerror(errno));
+    return 1;
+  }
+  ScaffoldContext *scaffold = open_scaffold();
+  if (scaffold == NULL)
+    return 1;
+  int lindex = get_lang_index(scaffold->confs, lang);
+  if (lindex != -1 && load_scaffold_language(scaffold, lindex) != 0) {
+    close_scaffold(scaffold);
+    return 1;
+  }
+  scaffold->jobs = default_jobs();
+  SnapshotRecorder *rec = create_snapshot_recorder(&scaffold->placeholders);
+  OutputSink disk = scaffold->sink;
+  scaffold->sink = (OutputSink) { .io = disk.io, .tar = NULL, .snapshot = rec, .fs = NULL };
+  int retval = create_new_project(scaffold, cwd, lang);
+  scaffold->sink = disk;
+  if (retval == 0 && write_snapshot(rec, output) != 0) {
+    ERRORF("could not write snapshot %s: %s\n", output, strerror(errno));
+    retval = 1;
   }
-  return create_new_project(lang);
+  if (retval == 0)
+    printf("Recorded %zu entries into %s.\n", rec->size, output);
+  destroy_snapshot_recorder(rec);
+  close_scaffold(scaffold);
+  return retval;
 }
 
-int main(int argc, char **argv)
+// Temporary files younger than this may belong to a run that is still
+// adding them to the object store.
+#define STORE_TMP_MAX_AGE 3600
+
+// Removes the objects no project links to any more, i.e. the ones with a
+// single link left. Projects that got reflinks don't use the objects and
+// objects still used by templates are added again on the next run.
+int handle_gc_command(int argc, char **argv)
+{
+  bool dryrun = false;
+  for (int i = 2; i < argc; i++) {
+    if (ISSTREQ(argv[i], "--dry-run") || ISSTREQ(argv[i], "-n"))
+      dryrun = true;
+    else {
+      ERRORF("Unknown flag `%s`.\n", argv[i]);
+      return 1;
+    }
+  }
+  char *store = find_object_store();
+  if (store == NULL) {
+    ERROR("Could not find the object store: HOME is not set.");
+    return 1;
+  }
+
+  double start = trace_begin();
+  size_t kept = 0;
+  size_t removed = 0;
+  uint64_t freed = 0;
+  int res = 0;
+  DIR *dir = opendir(store);
+  struct dirent *ent;
+  while (dir != NULL && (ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.')
+      continue;
+    char subpath[PATH_MAX];
+    snprintf(subpath, sizeof(subpath), "%s/%s", store, ent->d_name);
+    DIR *sub = opendir(subpath);
+    if (sub == NULL)
+      continue;
+    struct dirent *objent;
+    while ((objent = readdir(sub)) != NULL) {
+      struct stat st;
+      if (objent->d_name[0] == '.' || fstatat(dirfd(sub), objent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+        continue;
+      size_t len = strlen(objent->d_name);
+      bool tmp = len > 4 && ISSTREQ(objent->d_name + len - 4, ".tmp");
+      if (tmp ? st.st_mtime > time(NULL) - STORE_TMP_MAX_AGE : st.st_nlink > 1) {
+        kept++;
+        continue;
+      }
+      if (!dryrun && unlinkat(dirfd(sub), objent->d_name, 0) != 0) {
+        ERRORF("could not remove %s/%s: %s\n", subpath, objent->d_name, strerror(errno));
+        res = 1;
+        continue;
+      }
+      removed++;
+      freed += st.st_blocks * 512;
+    }
+    closedir(sub);
+    if (!dryrun)
+      rmdir(subpath);
+  }
+  if (dir != NULL)
+    closedir(dir);
+  trace_end("gc", "store", start, store);
+
+  printf("%s %zu objects (%.1f MB), %zu kept.\n", dryrun ? "Would remove" : "Removed",
+         removed, freed / 1e6, kept);
+  free(store);
+  return res;
+}
+
+int handle_command(int argc, char **argv)
 {
+  if (argc >= 2 && ISSTREQ(argv[1], "gc"))
+    return handle_gc_command(argc, argv);
+
   if (argc < 3) {
     ERROR("Not enough arguments provided. Expected at least 3.\n");
     help(argv[0]);
@@ -895,9 +6014,398 @@ int main(int argc, char **argv)
   }
   if (ISSTREQ(command, "config"))
     return handle_config_command(argc, argv);
+  if (ISSTREQ(command, "snapshot"))
+    return handle_snapshot_command(argc, argv);
   else {
     ERRORF("Unknown command `%s`.\n", command);
     return 1;
   }
   return 0;
 }
+
+// `--trace <file>` is accepted anywhere after the command name. It is
+// removed from `argv` so the command handlers never see it.
+char *take_trace_flag(int *argc, char **argv)
+{
+  for (int i = 2; i < *argc; i++) {
+    if (!ISSTREQ(argv[i], "--trace"))
+      continue;
+    if (i + 1 >= *argc) {
+      ERROR("No value specified for `trace` flag.");
+      exit(1);
+    }
+    char *path = argv[i + 1];
+    for (int j = i; j + 2 <= *argc; j++)
+      argv[j] = argv[j + 2];
+    *argc -= 2;
+    return path;
+  }
+  return NULL;
+}
+
+// Runs one command line. `--trace` is handled here so that it works the
+// same in-process and inside the daemon.
+int run_command(int argc, char **argv)
+{
+  char *tracepath = take_trace_flag(&argc, argv);
+  if (tracepath != NULL)
+    start_trace();
+  int status = handle_command(argc, argv);
+  if (tracepath != NULL && write_trace(tracepath) != 0) {
+    ERRORF("could not write trace %s: %s\n", tracepath, strerror(errno));
+    return 1;
+  }
+  return status;
+}
+
+// A request is a single SOCK_SEQPACKET message holding the client's
+// working directory followed by its argv, all NUL-terminated, with the
+// client's stdout and stderr attached as SCM_RIGHTS. The reply is the
+// exit status of the command as an int32_t. A connection closed without
+// a reply means the command died.
+#define DAEMON_MAX_REQUEST 65536
+#define DAEMON_MAX_ARGS 256
+#define DAEMON_SOCKET_NAME "boiling.sock"
+
+char *find_daemon_socket()
+{
+  char *runtime = getenv("XDG_RUNTIME_DIR");
+  char *dir = runtime != NULL && runtime[0] != '\0' ? strdup(runtime) : find_cache_dir();
+  if (dir == NULL)
+    return NULL;
+  char *path = concat_path_file(dir, DAEMON_SOCKET_NAME);
+  free(dir);
+  if (strlen(path) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+    free(path);
+    return NULL;
+  }
+  return path;
+}
+
+int connect_daemon(const char *path)
+{
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, path);
+  if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Only project creation and verification read the resident state, every
+// other command runs in-process.
+bool is_daemon_command(int argc, char **argv)
+{
+  if (argc < 3)
+    return false;
+  if (ISSTREQ(argv[1], "new"))
+    return true;
+  if (!ISSTREQ(argv[1], "config"))
+    return false;
+  for (int i = 2; i < argc; i++)
+    if (!ISSTREQ(argv[i], "--verify") && !ISSTREQ(argv[i], "-v") &&
+        strncmp(argv[i], "--format", 8) != 0 && (i == 2 || !ISSTREQ(argv[i - 1], "--format")))
+      return false;
+  return true;
+}
+
+// Hands the command to a running daemon. Returns its exit status, or -1
+// when no daemon is listening and the command should run in-process.
+int forward_to_daemon(int argc, char **argv)
+{
+  char *path = find_daemon_socket();
+  if (path == NULL)
+    return -1;
+  int fd = connect_daemon(path);
+  free(path);
+  if (fd == -1)
+    return -1;
+
+  char *request = malloc(DAEMON_MAX_REQUEST);
+  size_t size = 0;
+  if (getcwd(request, DAEMON_MAX_REQUEST) == NULL) {
+    free(request);
+    close(fd);
+    return -1;
+  }
+  size = strlen(request) + 1;
+  for (int i = 0; i < argc; i++) {
+    size_t len = strlen(argv[i]) + 1;
+    if (size + len > DAEMON_MAX_REQUEST || i >= DAEMON_MAX_ARGS) {
+      free(request);
+      close(fd);
+      return -1;
+    }
+    memcpy(request + size, argv[i], len);
+    size += len;
+  }
+
+  int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+  char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+  struct iovec iov = { .iov_base = request, .iov_len = size };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  fflush(stdout);
+  fflush(stderr);
+  ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  free(request);
+  if (sent != (ssize_t) size) {
+    close(fd);
+    return -1;
+  }
+
+  int32_t status;
+  ssize_t n;
+  while ((n = recv(fd, &status, sizeof(status), 0)) == -1 && errno == EINTR)
+    ;
+  close(fd);
+  return n == sizeof(status) ? status : 1;
+}
+
+// What the daemon last saw of the config file. The resident state is
+// rebuilt whenever the file's path, size or mtime changes, or when
+// `is_scaffold_fresh` finds the templates or the LICENSE changed.
+typedef struct {
+  char *path;
+  off_t size;
+  struct timespec mtime;
+} ResidentStamp;
+
+ResidentStamp resident_stamp = { 0 };
+
+void drop_resident_state()
+{
+  if (resident_scaffold != NULL)
+    destroy_scaffold_context(resident_scaffold);
+  if (resident_configs != NULL)
+    destroy_configs(resident_configs);
+  resident_scaffold = NULL;
+  resident_configs = NULL;
+}
+
+// Loads the config and every language's templates when the config file,
+// the LICENSE or a template changed since the last call. If the new config does not load, the
+// daemon keeps no state and each request loads the config itself, so its
+// errors reach the client instead of being hidden behind stale state.
+void refresh_resident_state()
+{
+  char *path = find_config();
+  struct stat st;
+  if (path == NULL || stat(path, &st) != 0) {
+    drop_resident_state();
+    free(resident_stamp.path);
+    resident_stamp.path = NULL;
+    free(path);
+    return;
+  }
+  if (resident_stamp.path != NULL && ISSTREQ(resident_stamp.path, path) &&
+      resident_stamp.size == st.st_size &&
+      resident_stamp.mtime.tv_sec == st.st_mtim.tv_sec &&
+      resident_stamp.mtime.tv_nsec == st.st_mtim.tv_nsec &&
+      (resident_scaffold == NULL || is_scaffold_fresh(resident_scaffold))) {
+    free(path);
+    return;
+  }
+  free(resident_stamp.path);
+  resident_stamp.path = path;
+  resident_stamp.size = st.st_size;
+  resident_stamp.mtime = st.st_mtim;
+
+  drop_resident_state();
+  double start = now_seconds();
+  Configs *confs = load_configs(false);
+  if (confs == NULL) {
+    fprintf(stderr, "warning: could not load %s, requests will load it themselves\n", path);
+    return;
+  }
+  ScaffoldContext *ctx = create_scaffold_context(confs);
+  if (ctx == NULL) {
+    destroy_configs(confs);
+    return;
+  }
+  for (size_t i = GLOBAL_CONFIG + 1; i < confs->size; i++) {
+    if (load_scaffold_language(ctx, i) != 0) {
+      destroy_scaffold_context(ctx);
+      destroy_configs(confs);
+      return;
+    }
+  }
+  resident_configs = confs;
+  resident_scaffold = ctx;
+  fprintf(stderr, "loaded %s in %.3fms\n", path, (now_seconds() - start) * 1000);
+}
+
+// Runs in a child forked off the daemon, so the request sees the resident
+// state copy-on-write and a crash or `exit` only takes the request down.
+void serve_request(int conn)
+{
+  char *request = malloc(DAEMON_MAX_REQUEST + 1);
+  char control[CMSG_SPACE(sizeof(int) * 2)];
+  struct iovec iov = { .iov_base = request, .iov_len = DAEMON_MAX_REQUEST };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+  ssize_t size = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (size <= 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || cmsg == NULL ||
+      cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2))
+    exit(1);
+  int fds[2];
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  request[size] = '\0';
+
+  char *argv[DAEMON_MAX_ARGS + 1];
+  int argc = 0;
+  char *cwd = request;
+  for (char *p = cwd + strlen(cwd) + 1; p < request + size && argc < DAEMON_MAX_ARGS; p += strlen(p) + 1)
+    argv[argc++] = p;
+  argv[argc] = NULL;
+
+  fflush(stdout);
+  fflush(stderr);
+  if (dup2(fds[0], STDOUT_FILENO) == -1 || dup2(fds[1], STDERR_FILENO) == -1)
+    exit(1);
+  close(fds[0]);
+  close(fds[1]);
+  int32_t status = 1;
+  if (chdir(cwd) != 0) {
+    ERRORF("could not enter %s: %s\n", cwd, strerror(errno));
+  }
+  else if (argc > 0 && is_daemon_command(argc, argv))
+    status = run_command(argc, argv);
+  else
+    ERROR("The daemon only runs `new` and `config --verify`.");
+  fflush(stdout);
+  fflush(stderr);
+  send(conn, &status, sizeof(status), MSG_NOSIGNAL);
+  exit(status);
+}
+
+volatile sig_atomic_t daemon_stopping = 0;
+
+void stop_daemon(int sig)
+{
+  (void) sig;
+  daemon_stopping = 1;
+}
+
+int handle_serve_command(int argc, char **argv)
+{
+  char *path = NULL;
+  for (int i = 2; i < argc; i++) {
+    if (ISSTREQ(argv[i], "--socket") && i + 1 < argc)
+      path = strdup(argv[++i]);
+    else {
+      ERRORF("Unknown flag `%s`.\n", argv[i]);
+      free(path);
+      return 1;
+    }
+  }
+  if (path == NULL && (path = find_daemon_socket()) == NULL) {
+    ERROR("Could not find a directory for the daemon socket.");
+    return 1;
+  }
+  if (strlen(path) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+    ERRORF("socket path %s is too long\n", path);
+    free(path);
+    return 1;
+  }
+
+  int existing = connect_daemon(path);
+  if (existing != -1) {
+    ERRORF("a daemon is already listening on %s\n", path);
+    close(existing);
+    free(path);
+    return 1;
+  }
+  // Nothing answers, so whatever is left at the path is stale.
+  unlink(path);
+  make_parent_dirs(path);
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strcpy(addr.sun_path, path);
+  mode_t mask = umask(0077);
+  int bound = sock == -1 ? -1 : bind(sock, (struct sockaddr *) &addr, sizeof(addr));
+  umask(mask);
+  if (bound != 0 || listen(sock, SOMAXCONN) != 0) {
+    ERRORF("could not listen on %s: %s\n", path, strerror(errno));
+    if (sock != -1)
+      close(sock);
+    free(path);
+    return 1;
+  }
+
+  // Requests are reaped by the kernel. Handlers are installed without
+  // SA_RESTART so that a stop signal interrupts `accept`.
+  struct sigaction ignore = { .sa_handler = SIG_IGN };
+  struct sigaction stop = { .sa_handler = stop_daemon };
+  sigaction(SIGCHLD, &ignore, NULL);
+  sigaction(SIGINT, &stop, NULL);
+  sigaction(SIGTERM, &stop, NULL);
+
+  refresh_resident_state();
+  fprintf(stderr, "listening on %s\n", path);
+  while (!daemon_stopping) {
+    int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+      if (errno != EINTR) {
+        ERRORF("accept failed: %s\n", strerror(errno));
+      }
+      continue;
+    }
+    refresh_resident_state();
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+      struct sigaction dfl = { .sa_handler = SIG_DFL };
+      sigaction(SIGCHLD, &dfl, NULL);
+      sigaction(SIGINT, &dfl, NULL);
+      sigaction(SIGTERM, &dfl, NULL);
+      close(sock);
+      serve_request(conn);
+    }
+    if (pid == -1) {
+      ERRORF("could not fork for a request: %s\n", strerror(errno));
+    }
+    close(conn);
+  }
+
+  close(sock);
+  unlink(path);
+  free(path);
+  drop_resident_state();
+  free(resident_stamp.path);
+  return 0;
+}
+
+#ifndef BOILING_NO_MAIN
+int main(int argc, char **argv)
+{
+  if (argc >= 2 && ISSTREQ(argv[1], "serve"))
+    return handle_serve_command(argc, argv);
+  if (is_daemon_command(argc, argv) && getenv("BOILING_NO_DAEMON") == NULL) {
+    int status = forward_to_daemon(argc, argv);
+    if (status != -1)
+      return status;
+  }
+  return run_command(argc, argv);
+}
+#endif // BOILING_NO_MAIN